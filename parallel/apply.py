@@ -6,14 +6,26 @@
 from __future__ import print_function
 
 import argparse
+import collections
+import ctypes
 import errno
 import fcntl
+import heapq
+import json
 import math
 import os
+import pickle
+import platform
+import re
 import select
 import shlex
 import signal
+import socket
+import stat
+import struct
 import sys
+import tempfile
+import termios
 import time
 
 try:
@@ -21,6 +33,14 @@ try:
 except ImportError:
   import subprocess
 
+try:
+  from os import cpu_count
+except ImportError:
+  from multiprocessing import cpu_count
+
+FSDecode = getattr(os, 'fsdecode', lambda x: x)  # pylint: disable=invalid-name
+FSEncode = getattr(os, 'fsencode', lambda x: x)  # pylint: disable=invalid-name
+
 SUBST_HELP = [
     '  Default (-a or positional) substitution options:',
     '    %P full path to <item> (i.e., verbatim <item>)',
@@ -42,6 +62,16 @@ SUBST_HELP = [
     '',
     '  Machine list (-m) substitution options:',
     '    %M machine name',
+    '    With -a or -f, items are distributed across the machines, and',
+    '    <machine>/<n> allows n items at once on <machine> (default 1).',
+    '',
+    '  Batching (-a or -f) substitution options:',
+    '    %@ each item in the batch, repeating the argument containing it;',
+    '       other substitutions in that argument apply to each item',
+    '',
+    '  Always available:',
+    '    %S slot number of the job (1 to the number of jobs at once),',
+    '       reused as jobs finish; also selects the --pin placement',
 ]
 
 
@@ -55,6 +85,10 @@ SIG_LIST = [
     ]
 SIG_MAP = dict(zip([getattr(signal, _x) for _x in SIG_LIST], SIG_LIST))
 SIG_WAIT = set([getattr(signal, _x) for _x in ['SIGUSR1', 'SIGUSR2']])
+SIG_NAMES = {}
+for _x, _y in sorted(vars(signal).items()):
+  if _x.startswith('SIG') and not _x.startswith('SIG_'):
+    SIG_NAMES.setdefault(int(_y), _x)
 
 
 class Error(Exception):
@@ -65,17 +99,54 @@ class UnknownInterpolation(Error):
   """Unknown interpolation character."""
 
 
-class SignalInterrupt(Error):
-  """Exception for interrupts via signals."""
-  # Python >=3.5 retries EINTR, so we need an exception to break out of
-  # poll, etc.  Used instead of InterruptedError, which doesn't exist
-  # in all Python versions.
-  # However, one has to be careful to raise this exception sparingly.
-  # Not only does one want to avoid using it outside the intended calls,
-  # but some OS/Python combinations seem to have a race with the try/except
-  # setup such that the exception may miss being caught by the try/except.
-  # In this case, the backtrace actually shows the exception as occuring
-  # within the try/except that should catch it.
+class DependencyError(Error):
+  """Invalid item dependencies."""
+
+
+class HostSpecError(Error):
+  """Invalid <machine>[/<n>] specification."""
+
+
+def KillGroup(pgid, sig):
+  """Signal a process group, if it still exists."""
+  try:
+    os.killpg(pgid, sig)
+  except OSError as exc:
+    if exc.errno != errno.ESRCH:
+      raise
+
+
+def SetNonblocking(fileobj, nonblock):
+  """Set or clear O_NONBLOCK on a file or fd."""
+  ofl = fcntl.fcntl(fileobj, fcntl.F_GETFL)
+  newflag = ofl | os.O_NONBLOCK if nonblock else ofl & ~os.O_NONBLOCK
+  fcntl.fcntl(fileobj, fcntl.F_SETFL, newflag)
+
+
+def ReadInto(fd, view):
+  """Read from an fd into a writable buffer; return the byte count."""
+  if hasattr(os, 'readv'):
+    return os.readv(fd, [view])
+  data = os.read(fd, len(view))
+  view[:len(data)] = data
+  return len(data)
+
+
+def PipeAvailable(fd):
+  """Get the number of bytes waiting in a pipe."""
+  return struct.unpack('=i', fcntl.ioctl(fd, termios.FIONREAD, b'\0' * 4))[0]
+
+
+def WriteAll(fd, data):
+  """Write all of the data to an fd, waiting if it's nonblocking."""
+  view = memoryview(data)
+  while len(view):
+    try:
+      view = view[os.write(fd, view):]
+    except OSError as exc:
+      if exc.errno not in (errno.EAGAIN, errno.EWOULDBLOCK):
+        raise
+      select.select([], [fd], [])
 
 
 class PollCompat(object):
@@ -138,10 +209,12 @@ class PollCompat(object):
 
 
 class Poller(object):
-  """Safely interruptible select.poll()."""
-  # This ensures that the signal exception is limited to the actual poll.
+  """Poll object which also wakes up on signals."""
+  # Signals are delivered via signal.set_wakeup_fd() into a pipe registered
+  # with the poll object, so they just look like another readable fd.
+  # This avoids racing a signal against entering the poll, without needing
+  # to break out of it with an exception (Python >=3.5 retries EINTR).
   sigs_rcvd = set()
-  interruptible = False
 
   try:
     POLL_CLS = select.poll
@@ -161,33 +234,41 @@ class Poller(object):
     self.register = poller.register
     self.modify = poller.modify
     self.unregister = poller.unregister
+    self.wakeup_r, wakeup_w = os.pipe()
+    for fd in (self.wakeup_r, wakeup_w):
+      SetNonblocking(fd, True)
+    signal.set_wakeup_fd(wakeup_w)
+    poller.register(self.wakeup_r, self.POLLIN)
 
   def poll(self, timeout=None):
-    """Poll with signal interrupt allowed."""
-    cls = type(self)
-    cur_sigs = cls.sigs_rcvd
-    try:
-      # Try to avoid race with exception setup
-      result = self.poller.poll(1)  # Very short timeout before interruptible
-      if result:
-        return result
-      cls.interruptible = True
-      # Avoid a race with a signal immediately preceding "interruptible"
-      if cur_sigs == cls.sigs_rcvd:
-        result = self.poller.poll(timeout)
-      else:
-        result = []
-      cls.interruptible = False
-    except SignalInterrupt as intexc:
-      _ = intexc  # Only for debugging
-      cls.interruptible = False
-      result = []
+    """Poll, returning early (maybe with no events) on a signal."""
+    try:
+      result = self.poller.poll(timeout)
+    except select.error as exc:
+      # Python <3.5 reports signals as EINTR
+      if exc.args[0] != errno.EINTR:
+        raise
+      return []
+    for idx, (xfd, _) in enumerate(result):
+      if xfd == self.wakeup_r:
+        del result[idx]
+        self._Drain()
+        break
     return result
 
+  def _Drain(self):
+    try:
+      while os.read(self.wakeup_r, 4096):
+        pass
+    except OSError:
+      pass
+
   @classmethod
-  def Signal(cls, signum):
+  def Signal(cls, signum, handler=None):
     """Arm signal handler for given signal."""
-    signal.signal(signum, cls._SignalHandler)
+    signal.signal(signum, handler or cls._SignalHandler)
+    if hasattr(signal, 'siginterrupt'):
+      signal.siginterrupt(signum, False)
 
   @classmethod
   def _SignalHandler(cls, signum, stack):
@@ -199,8 +280,133 @@ class Poller(object):
     """
     _ = stack
     cls.sigs_rcvd |= set([signum])
-    if cls.interruptible:
-      raise SignalInterrupt(signum)
+
+
+class ChildWatcher(object):
+  """Exit notifier for subprocesses, via pidfd or SIGCHLD."""
+  # Uses a pidfd per process where available (Linux >=5.3, Python >=3.9),
+  # else a SIGCHLD handler, which wakes up the poller like other signals.
+  #
+  # Where possible, we're also a child subreaper, so that descendants
+  # orphaned by a job's exit become our children rather than init's, and
+  # are reaped (and counted) here.
+  PR_SET_CHILD_SUBREAPER = 36
+  sigchld = False
+
+  def __init__(self, poller, zygote=None):
+    self.poller = poller
+    self.pidfds = {}  # pidfd -> process
+    self.pids = {}  # pid -> process, for our own children
+    self.zygote = zygote
+    self.zpids = {}  # pid -> process, for processes from the zygote
+    self.use_pidfd = self._HavePidfd()
+    self.subreaper = self._SetSubreaper()
+    self.strays = False  # Orphans may need reaping
+    self.reaped = 0
+    if zygote:
+      poller.register(zygote.fd, poller.POLLIN)
+    if not self.use_pidfd or self.subreaper:
+      poller.Signal(signal.SIGCHLD, self._SignalHandler)
+
+  @classmethod
+  def _SetSubreaper(cls):
+    # Reaping orphans without stealing our jobs' exits needs waitid()
+    if not hasattr(os, 'waitid') or not sys.platform.startswith('linux'):
+      return False
+    try:
+      libc = ctypes.CDLL(None, use_errno=True)
+      return libc.prctl(cls.PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) == 0
+    except (AttributeError, OSError):
+      return False
+
+  @staticmethod
+  def _HavePidfd():
+    if not hasattr(os, 'pidfd_open'):
+      return False
+    try:
+      os.close(os.pidfd_open(os.getpid()))
+    except OSError:
+      return False
+    return True
+
+  @classmethod
+  def _SignalHandler(cls, signum, stack):
+    """Signal handler to note child exit(s)."""
+    _ = signum, stack
+    cls.sigchld = True
+
+  def Add(self, proc):
+    """Start watching a process."""
+    if isinstance(proc.proc, ZygoteProcess):
+      self.zpids[proc.proc.pid] = proc
+      return
+    self.pids[proc.proc.pid] = proc
+    if self.use_pidfd:
+      proc.pidfd = pidfd = os.pidfd_open(proc.proc.pid)
+      self.pidfds[pidfd] = proc
+      self.poller.register(pidfd, self.poller.POLLIN)
+
+  def Remove(self, proc):
+    """Stop watching a finished process."""
+    self.zpids.pop(proc.proc.pid, None)
+    self.pids.pop(proc.proc.pid, None)
+    pidfd = proc.pidfd
+    if pidfd is not None:
+      self.poller.unregister(pidfd)
+      del self.pidfds[pidfd]
+      os.close(pidfd)
+      proc.pidfd = None
+
+  def Exited(self, xfd):
+    """Get process which may have exited, given a ready fd, or None."""
+    if self.zygote and xfd == self.zygote.fd:
+      if not self.zygote.Receive():
+        self.poller.unregister(xfd)
+        print('%Launcher helper exited; failing its processes',
+              file=sys.stderr)
+        self.zygote.Lost(list(self.zpids), kill=self.subreaper)
+      return None  # Reported by Signaled()
+    return self.pidfds.get(xfd)
+
+  def Signaled(self, procs):
+    """Get processes which may have exited, given a SIGCHLD or zygote."""
+    result = []
+    if self.zygote:
+      for pid in self.zygote.TakeExits():
+        proc = self.zpids.get(pid)
+        if proc:
+          result.append(proc)
+    cls = type(self)
+    if not cls.sigchld:
+      return result
+    cls.sigchld = False
+    self.strays = self.subreaper
+    if self.use_pidfd:
+      return result
+    # SIGCHLD doesn't say who, so check everyone
+    return list(procs)
+
+  def ReapStrays(self, force=False):
+    """Reap any exited orphans, leaving our own children alone."""
+    if not self.strays and not (force and self.subreaper):
+      return
+    self.strays = False
+    while True:
+      try:
+        info = os.waitid(os.P_ALL, 0, os.WEXITED | os.WNOHANG | os.WNOWAIT)
+      except OSError as exc:
+        if exc.errno != errno.ECHILD:
+          raise
+        return
+      if not info:
+        return
+      pid = info.si_pid
+      if pid in self.pids or (self.zygote and pid == self.zygote.pid):
+        # One of ours is first in line; try again once it's been handled
+        self.strays = True
+        return
+      os.waitpid(pid, 0)
+      self.reaped += 1
 
 
 def Interpolate(text, value, mapdict):
@@ -230,8 +436,14 @@ def Interpolate(text, value, mapdict):
 
 NULL_MAP = {}
 
+BATCH_SUBST = '%@'
+
+HOST_KEY = 'M'
+
+SLOT_KEY = 'S'
+
 MACH_MAP = {
-    'M': str,
+    HOST_KEY: str,
     }
 
 PATH_MAP = {
@@ -255,12 +467,16 @@ ARG_MAP = {
     }
 
 
+def SplitMsecs(tstamp):
+  """Round a timestamp to (seconds, milliseconds)."""
+  return divmod(int(round(tstamp * 1000)), 1000)
+
+
 def TimeStr(tstamp):
   """Get string version of timestamp, with milliseconds."""
-  tsplit = math.modf(tstamp)
-  tsint = time.strftime('%H:%M:%S', time.localtime(int(tsplit[1])))
-  tsfrac = ('%.3f' % tsplit[0]).split('.')[-1]
-  return '.'.join([tsint, tsfrac])
+  second, msecs = SplitMsecs(tstamp)
+  tsint = time.strftime('%H:%M:%S', time.localtime(second))
+  return '%s.%03d' % (tsint, msecs)
 
 
 def ElapsedStr(delta):
@@ -276,50 +492,942 @@ def ElapsedStr(delta):
   return '%02d:%02d:%06.3f' % (hours, mins, secf)
 
 
-class Line(object):  # pylint: disable=too-few-public-methods
-  """Class for line of output."""
-  __slots__ = ('iserr', 'time', 'text')
+SIZE_SUFFIXES = 'KMGT'
+
+
+def SizeStr(nbytes):
+  """Get string version of a byte count, in binary units."""
+  size = float(nbytes)
+  suffix = ''
+  for unit in SIZE_SUFFIXES:
+    if size < 1024:
+      break
+    size /= 1024
+    suffix = unit
+  return '%.1f%siB' % (size, suffix) if suffix else '%dB' % nbytes
+
+
+def ParseSize(text):
+  """Parse a byte count with an optional K, M, G, or T suffix."""
+  text = text.strip().upper().rstrip('B').rstrip('I')
+  scale = 1
+  if text and text[-1] in SIZE_SUFFIXES:
+    scale = 1024 ** (SIZE_SUFFIXES.index(text[-1]) + 1)
+    text = text[:-1]
+  try:
+    return int(float(text) * scale)
+  except ValueError:
+    raise argparse.ArgumentTypeError('invalid size: %s' % text)
+
+
+TAG_SEPS = (b': ', b':: ')  # Separators for stdout, stderr lines
+
 
-  def __init__(self, iserr, text, tstamp=None):
-    self.iserr = iserr
-    self.time = tstamp or time.time()
-    self.text = text
+class Stamper(object):  # pylint: disable=too-few-public-methods
+  """Timestamp prefixes for output, redoing strftime once per second."""
+  second = None
+  text = b''
 
-  def Print(self, name=None, tstamp=False, where=(sys.stdout, sys.stderr)):
-    """Print line with optional name and/or timestamp."""
-    print(self.Format(self.text, self.iserr, name, tstamp and self.time),
-          file=where[self.iserr])
+  @classmethod
+  def Get(cls, tstamp):
+    """Get bytes version of timestamp, with milliseconds."""
+    second, msecs = SplitMsecs(tstamp)
+    if second != cls.second:
+      cls.second = second
+      cls.text = time.strftime('%H:%M:%S',
+                               time.localtime(second)).encode('ascii')
+    return b'%s.%03d' % (cls.text, msecs)
+
+
+def WriteBytes(stream, data):
+  """Write bytes to a text stream, bypassing its encoding."""
+  binary = getattr(stream, 'buffer', None)
+  if binary is None:  # Python 2 files take bytes directly
+    stream.write(data)
+    return
+  # Keep order with anything printed, and keep ttys live
+  stream.flush()
+  binary.write(data)
+  if stream.line_buffering:
+    binary.flush()
+
+
+def CloexecPipe():
+  """Create a pipe whose fds won't be inherited across exec."""
+  # Python >=3.4 makes this the default, but pipe2() avoids the extra fcntl
+  pipe2 = getattr(os, 'pipe2', None)
+  if pipe2:
+    return pipe2(os.O_CLOEXEC)
+  return os.pipe()
+
+
+class Placement(object):
+  """CPU (and optionally memory) placement for job slots."""
+  # Children inherit the launcher's CPU affinity, memory policy, and cgroup,
+  # so the launcher adopts a job's placement just around each launch.  That
+  # works the same for Popen, posix_spawn(), and the zygote.  A placement
+  # ("pin") is (cpus, node, cgroup), with None for any part not wanted.
+  AVAILABLE = hasattr(os, 'sched_setaffinity')
+  NODE_DIR = '/sys/devices/system/node'
+  MPOL_DEFAULT = 0
+  MPOL_BIND = 2
+  # set_mempolicy() isn't in libc, so it's called by number
+  MPOL_SYSCALLS = {'x86_64': 238, 'aarch64': 237, 'riscv64': 237}
+  MASK_BITS = 1024
+  libc = None
+
+  def __init__(self, mode):
+    self.mode = mode
+    self.cpus = sorted(os.sched_getaffinity(0))
+    self.nodes = []  # (node, cpus)
+    if mode == 'node':
+      self.nodes = self._Nodes()
+    if not self.nodes:
+      self.nodes = [(None, self.cpus)]
 
   @staticmethod
-  def Format(text, iserr=False, name=None, tstamp=None):
-    """Format output line with optional name and/or timestamp."""
-    if not isinstance(text, str):
-      text = text.decode(encoding='latin-1')
-    sep = '::' if iserr else ':'
-    if tstamp:
-      tstext = TimeStr(tstamp)
-      if name:
-        return '%s @%s%s %s' % (name, tstext, sep, text)
-      return '%s%s %s' % (tstext, sep, text)
-    if name:
-      return '%s%s %s' % (name, sep, text)
-    return text
+  def _ParseList(text):
+    """Parse a sysfs list like 0-3,8-11."""
+    result = []
+    for part in text.strip().split(','):
+      if part:
+        low, _, high = part.partition('-')
+        result.extend(range(int(low), int(high or low) + 1))
+    return result
 
+  def _Nodes(self):
+    try:
+      names = os.listdir(self.NODE_DIR)
+    except OSError:
+      return []
+    nodes = []
+    for name in names:
+      if not name.startswith('node') or not name[4:].isdigit():
+        continue
+      try:
+        with open(os.path.join(self.NODE_DIR, name, 'cpulist')) as cpulist:
+          cpus = self._ParseList(cpulist.read())
+      except (IOError, OSError):
+        continue
+      cpus = [x for x in cpus if x in self.cpus]
+      if cpus:
+        nodes.append((int(name[4:]), cpus))
+    return sorted(nodes)
 
-class Process(object):  # pylint: disable=too-many-instance-attributes
-  """Class for subprocesses."""
-  # Assumes the command won't expect input via stdin
-  def __init__(self, name, args, shell=False):
+  @classmethod
+  def CanBind(cls):
+    """Check whether memory can be bound to a node."""
+    return platform.machine() in cls.MPOL_SYSCALLS
+
+  def ForSlot(self, slot):
+    """Get the CPUs and NUMA node (or None) for a slot."""
+    if self.mode == 'cpu':
+      return [self.cpus[(slot - 1) % len(self.cpus)]], None
+    node, cpus = self.nodes[(slot - 1) % len(self.nodes)]
+    return cpus, node if self.CanBind() else None
+
+  @classmethod
+  def _SetMemPolicy(cls, node):
+    if cls.libc is None:
+      cls.libc = ctypes.CDLL(None, use_errno=True)
+    nbits = ctypes.sizeof(ctypes.c_ulong) * 8
+    mask = (ctypes.c_ulong * (cls.MASK_BITS // nbits))()
+    mode = cls.MPOL_DEFAULT
+    if node is not None:
+      mask[node // nbits] = 1 << (node % nbits)
+      mode = cls.MPOL_BIND
+    ret = cls.libc.syscall(cls.MPOL_SYSCALLS[platform.machine()], mode,
+                           mask if node is not None else None,
+                           ctypes.c_ulong(cls.MASK_BITS + 1))
+    if ret == -1:
+      err = ctypes.get_errno()
+      raise OSError(err, 'set_mempolicy: %s' % os.strerror(err))
+
+  @staticmethod
+  def _MoveTo(cgroup):
+    Cgroups.Write(cgroup, 'cgroup.procs', str(os.getpid()))
+
+  @classmethod
+  def Launch(cls, pin, func, *args, **kwargs):
+    """Call func, which launches a process, with the given placement."""
+    if not pin:
+      return func(*args, **kwargs)
+    cpus, node, cgroup = pin
+    old = None
+    bound = moved = False
+    # Undo whatever was done, even if a later step fails
+    try:
+      if cpus:
+        old = os.sched_getaffinity(0)
+        os.sched_setaffinity(0, cpus)
+      if node is not None:
+        cls._SetMemPolicy(node)
+        bound = True
+      if cgroup:
+        cls._MoveTo(cgroup)
+        moved = True
+      return func(*args, **kwargs)
+    finally:
+      if moved:
+        cls._MoveTo(Cgroups.HomeOf(cgroup))
+      if old:
+        os.sched_setaffinity(0, old)
+      if bound:
+        cls._SetMemPolicy(None)
+
+
+class Cgroups(object):
+  """Per-job cgroup v2 leaves, for resource limits and accounting."""
+  # We create apply-<pid> under our own cgroup, with a "main" leaf holding
+  # ourselves (and any helper, i.e. the zygote), and a leaf per job.
+  # Moving ourselves out of our original cgroup lets controllers be enabled
+  # there if it has no other processes (or is delegated to us, or is the
+  # root).
+  CPU_PERIOD = 100000  # us
+
+  def __init__(self, mem_max=None, cpu_max=None, helpers=()):
+    """Set up the hierarchy; raise OSError or IOError if unavailable."""
+    self.mem_max = mem_max
+    self.cpu_max = cpu_max
+    self.top = self._Own()
+    self.path = os.path.join(self.top, 'apply-%d' % os.getpid())
+    self.home = os.path.join(self.path, 'main')
+    self.count = 0
+    self.stale = []  # Leaves not yet removable
+    self.enabled = []  # Controllers we enabled in our original cgroup
+    wanted = set()
+    if mem_max:
+      wanted.add('memory')
+    if cpu_max:
+      wanted.add('cpu')
+    available = set(self.Read(self.top, 'cgroup.controllers').split())
+    missing = wanted - available
+    if missing:
+      raise OSError(errno.ENOTSUP, 'controllers not delegated: %s'
+                    % ' '.join(sorted(missing)))
+    # Memory accounting gives the peak, even without a limit
+    wanted |= available & set(['memory'])
+    self.wanted = sorted(wanted)
+    os.mkdir(self.path)
+    try:
+      os.mkdir(self.home)
+      for pid in [os.getpid()] + list(helpers):
+        self.Write(self.home, 'cgroup.procs', str(pid))
+      enabled = set(self.Read(self.top, 'cgroup.subtree_control').split())
+      self.enabled = sorted(wanted - enabled)
+      self._Enable(self.top, self.enabled)
+      self._Enable(self.path, self.wanted)
+    except (IOError, OSError):
+      self.Close()
+      raise
+
+  @staticmethod
+  def HomeOf(leaf):
+    """Get the launchers' cgroup corresponding to a job's leaf."""
+    return os.path.join(os.path.dirname(leaf), 'main')
+
+  @staticmethod
+  def _Own():
+    mounts = [x.split() for x in open('/proc/self/mountinfo')]
+    mount = [x[4] for x in mounts if x[x.index('-') + 1] == 'cgroup2']
+    own = [x[3:] for x in open('/proc/self/cgroup') if x.startswith('0::')]
+    if not mount or not own:
+      raise OSError(errno.ENOENT, 'no cgroup v2 hierarchy')
+    return os.path.join(mount[0], own[0].strip().lstrip('/'))
+
+  @staticmethod
+  def Read(path, name):
+    """Read a cgroup control file."""
+    with open(os.path.join(path, name)) as ctlfile:
+      return ctlfile.read()
+
+  @staticmethod
+  def Write(path, name, text):
+    """Write a cgroup control file in one write()."""
+    fd = os.open(os.path.join(path, name), os.O_WRONLY)
+    try:
+      os.write(fd, text.encode('ascii'))
+    finally:
+      os.close(fd)
+
+  def _Enable(self, path, controllers, enable=True):
+    if controllers:
+      sign = '+' if enable else '-'
+      self.Write(path, 'cgroup.subtree_control',
+                 ' '.join([sign + x for x in controllers]))
+
+  def Create(self):
+    """Create a leaf for a job, with the limits; return None on failure."""
+    self.count += 1
+    leaf = os.path.join(self.path, 'job%d' % self.count)
+    try:
+      os.mkdir(leaf)
+    except OSError as exc:
+      print('%%Unable to create cgroup %s: %s' % (leaf, exc),
+            file=sys.stderr)
+      return None
+    try:
+      if self.mem_max:
+        self.Write(leaf, 'memory.max', str(self.mem_max))
+        # An OOM kill takes out the whole job, not just one process of it
+        self.Write(leaf, 'memory.oom.group', '1')
+      if self.cpu_max:
+        self.Write(leaf, 'cpu.max', '%d %d' % (
+            self.cpu_max * self.CPU_PERIOD, self.CPU_PERIOD))
+    except (IOError, OSError) as exc:
+      print('%%Unable to set limits in cgroup %s: %s' % (leaf, exc),
+            file=sys.stderr)
+      os.rmdir(leaf)
+      return None
+    return leaf
+
+  def Usage(self, leaf):
+    """Get (peak memory or None, CPU seconds) for a leaf."""
+    peak = None
+    try:
+      peak = int(self.Read(leaf, 'memory.peak'))
+    except (IOError, OSError, ValueError):
+      pass  # Needs the memory controller, and Linux >=5.19
+    stats = dict([x.split() for x in self.Read(leaf, 'cpu.stat').splitlines()])
+    return peak, int(stats['usage_usec']) / 1e6
+
+  @staticmethod
+  def Total(usages):
+    """Combine Usage() results: the highest peak, and total CPU time."""
+    usages = [x for x in usages if x]
+    if not usages:
+      return None
+    peaks = [x[0] for x in usages if x[0] is not None]
+    return (max(peaks) if peaks else None), sum([x[1] for x in usages])
+
+  @staticmethod
+  def _Rmdir(leaf):
+    try:
+      os.rmdir(leaf)
+    except OSError:
+      return False
+    return True
+
+  def Remove(self, leaf):
+    """Remove a job's leaf, or defer it while stragglers remain."""
+    if not self._Rmdir(leaf):
+      self.stale.append(leaf)
+
+  def Close(self):
+    """Remove the hierarchy and return to our original cgroup."""
+    for leaf in self.stale:
+      try:
+        self.Write(leaf, 'cgroup.kill', '1')  # Linux >=5.14
+      except (IOError, OSError):
+        pass
+    # Give killed stragglers a moment to go away
+    deadline = time.time() + 1
+    while True:
+      self.stale = [x for x in self.stale if not self._Rmdir(x)]
+      if not self.stale or time.time() > deadline:
+        break
+      time.sleep(0.01)
+    try:
+      # Our original cgroup can't hold processes with controllers enabled
+      self._Enable(self.path, self.wanted, False)
+      self._Enable(self.top, self.enabled, False)
+      self.Write(self.top, 'cgroup.procs', str(os.getpid()))
+      os.rmdir(self.home)
+      os.rmdir(self.path)
+    except (IOError, OSError) as exc:
+      print('%%Unable to remove cgroup %s: %s' % (self.path, exc),
+            file=sys.stderr)
+
+
+def CloexecInherited():
+  """Mark fds we inherited (other than stdio) close-on-exec."""
+  # Popen's close_fds keeps them from children; this does the same for
+  # posix_spawn(), whose children only lose O_CLOEXEC fds
+  try:
+    fds = [int(x) for x in os.listdir('/proc/self/fd')]
+  except OSError:
+    return  # Not Linux; only our own (O_CLOEXEC) fds are a given there
+  for fd in fds:
+    if fd <= 2:
+      continue
+    try:
+      flags = fcntl.fcntl(fd, fcntl.F_GETFD)
+      if not flags & fcntl.FD_CLOEXEC:
+        fcntl.fcntl(fd, fcntl.F_SETFD, flags | fcntl.FD_CLOEXEC)
+    except (IOError, OSError):
+      pass  # E.g., the listdir() fd, now closed
+
+
+class SpawnedProcess(object):
+  """Minimal subprocess.Popen work-alike using posix_spawn()."""
+  # Popen forks (or at best vforks after extra setup) and then closes every
+  # fd not wanted by the child, which gets expensive with thousands of pipes
+  # open.  posix_spawn() lets libc use vfork semantics, and since all our
+  # fds are O_CLOEXEC (including inherited ones, via CloexecInherited() at
+  # startup), exec closes them with no per-fd work (so there's no need for
+  # close_range() either).
+  SHELL = '/bin/sh'
+
+  def __init__(self, args, shell=False, executable=None, sigdef=(),
+               stdin=False, in_fd=None, out_fd=None, err_fd=None):
+    # pylint: disable=too-many-arguments,too-many-locals
+    if shell:
+      path = executable or self.SHELL
+      argv = [path, '-c', args]
+      spawn = os.posix_spawn
+    else:
+      argv = list(args)
+      path = argv[0]
+      spawn = os.posix_spawnp
+    self.returncode = None
+    self.stdin = self.stdout = self.stderr = None
+    in_r = in_w = out_r = out_w = err_r = err_w = None
+    if out_fd is None:
+      out_r, out_w = CloexecPipe()
+    if err_fd is None:
+      err_r, err_w = CloexecPipe()
+    if in_fd is not None:
+      in_action = (os.POSIX_SPAWN_DUP2, in_fd, 0)
+    elif stdin:
+      in_r, in_w = CloexecPipe()
+      in_action = (os.POSIX_SPAWN_DUP2, in_r, 0)
+    else:
+      # Equivalent to a dummy input pipe that's closed immediately
+      in_action = (os.POSIX_SPAWN_OPEN, 0, os.devnull, os.O_RDONLY, 0)
+    actions = [
+        in_action,
+        (os.POSIX_SPAWN_DUP2, out_fd if out_w is None else out_w, 1),
+        (os.POSIX_SPAWN_DUP2, err_fd if err_w is None else err_w, 2),
+        ]
+    # Python ignores these, but Popen restores them to default in the child
+    sigdef = list(sigdef) + [signal.SIGPIPE, signal.SIGXFSZ]
+    # Each job gets its own process group, so its descendants get signals
+    kwargs = {'file_actions': actions, 'setsigdef': sigdef, 'setpgroup': 0}
+    try:
+      self.pid = spawn(path, argv, os.environ, **kwargs)
+    except Exception:
+      for fd in (out_r, err_r, in_w):
+        if fd is not None:
+          os.close(fd)
+      raise
+    finally:
+      for fd in (out_w, err_w, in_r):
+        if fd is not None:
+          os.close(fd)
+    if in_w is not None:
+      self.stdin = os.fdopen(in_w, 'wb', 0)
+    if out_r is not None:
+      self.stdout = os.fdopen(out_r, 'rb', 0)
+    if err_r is not None:
+      self.stderr = os.fdopen(err_r, 'rb', 0)
+
+  def poll(self):
+    """Check for exit without waiting; return exit code or None."""
+    if self.returncode is None:
+      pid, status = os.waitpid(self.pid, os.WNOHANG)
+      if pid:
+        if os.WIFSIGNALED(status):
+          self.returncode = -os.WTERMSIG(status)
+        else:
+          self.returncode = os.WEXITSTATUS(status)
+    return self.returncode
+
+  def wait(self):
+    """Wait for exit; return exit code."""
+    while self.returncode is None:
+      _, status = os.waitpid(self.pid, 0)
+      if os.WIFSIGNALED(status):
+        self.returncode = -os.WTERMSIG(status)
+      elif os.WIFEXITED(status):
+        self.returncode = os.WEXITSTATUS(status)
+    return self.returncode
+
+  def send_signal(self, sig):
+    """Signal the process group, unless the process was already reaped."""
+    if self.returncode is None:
+      KillGroup(self.pid, sig)
+
+  def kill(self):
+    """Kill the process."""
+    self.send_signal(signal.SIGKILL)
+
+
+class Zygote(object):
+  """Helper process which launches subprocesses on our behalf."""
+  # The helper is forked at startup while we're still small, and launches
+  # processes on request over a unix socket, passing back the output pipes
+  # with SCM_RIGHTS.  Launch cost thus doesn't grow with our own size or
+  # number of open fds.  Since the subprocesses are the helper's children,
+  # it reaps them and reports exit codes, and signals go through it so
+  # that a reaped pid is never signaled.
+  #
+  # Messages are length-prefixed pickles on a stream socket, with any fds
+  # attached to the length prefix.
+  HEADER = struct.Struct('=I')
+  MAX_FDS = 3
+  AVAILABLE = (hasattr(socket.socket, 'sendmsg')
+               and hasattr(os, 'posix_spawnp'))
+
+  def __init__(self):
+    parent_sock, child_sock = socket.socketpair(socket.AF_UNIX,
+                                                socket.SOCK_STREAM)
+    self.pid = os.fork()
+    if not self.pid:
+      parent_sock.close()
+      status = 1
+      try:
+        self._Serve(child_sock)
+        status = 0
+      finally:
+        os._exit(status)  # pylint: disable=protected-access
+    child_sock.close()
+    self.sock = parent_sock
+    self.fd = parent_sock.fileno()
+    self.codes = {}  # pid -> exit code, not yet collected
+    self.exited = []  # pids with exit codes, in order received
+    self.dead = False  # The helper has exited
+
+  @classmethod
+  def _Send(cls, sock, msg, fds=()):
+    data = pickle.dumps(msg, pickle.HIGHEST_PROTOCOL)
+    data = cls.HEADER.pack(len(data)) + data
+    anc = []
+    if fds:
+      anc = [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+              struct.pack('=%di' % len(fds), *fds))]
+    sent = sock.sendmsg([data], anc)
+    if sent < len(data):
+      sock.sendall(data[sent:])
+
+  @classmethod
+  def _Recv(cls, sock):
+    """Receive a message and any fds; message is None at EOF."""
+    fdsize = struct.calcsize('=i')
+    data, anc, _, _ = sock.recvmsg(cls.HEADER.size,
+                                   socket.CMSG_SPACE(cls.MAX_FDS * fdsize))
+    fds = []
+    for level, kind, cdata in anc:
+      if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+        cdata = cdata[:len(cdata) - len(cdata) % fdsize]
+        fds.extend(struct.unpack('=%di' % (len(cdata) // fdsize), cdata))
+    while data and len(data) < cls.HEADER.size:
+      data += sock.recv(cls.HEADER.size - len(data))
+    if not data:
+      return None, fds
+    length = cls.HEADER.unpack(data)[0]
+    chunks = []
+    while length:
+      chunk = sock.recv(length)
+      if not chunk:
+        return None, fds
+      chunks.append(chunk)
+      length -= len(chunk)
+    return pickle.loads(b''.join(chunks)), fds
+
+  @classmethod
+  def _Serve(cls, sock):
+    """Main loop of the helper process."""
+    # Terminal signals are for the main process to forward
+    for sig in SIG_MAP:
+      signal.signal(sig, signal.SIG_IGN)
+    sigdef = list(SIG_MAP)
+    sock_fd = sock.fileno()
+    os.closerange(3, sock_fd)
+    wake_r, wake_w = CloexecPipe()
+    for fd in (wake_r, wake_w):
+      SetNonblocking(fd, True)
+    signal.set_wakeup_fd(wake_w)
+    signal.signal(signal.SIGCHLD, lambda signum, stack: None)
+    children = {}
+    while True:
+      try:
+        ready = select.select([sock_fd, wake_r], [], [])[0]
+      except select.error as exc:
+        if exc.args[0] != errno.EINTR:
+          raise
+        continue
+      if wake_r in ready:
+        try:
+          while os.read(wake_r, 4096):
+            pass
+        except OSError:
+          pass
+        while children:
+          try:
+            pid, status = os.waitpid(-1, os.WNOHANG)
+          except OSError:
+            break
+          if not pid:
+            break
+          if os.WIFSIGNALED(status):
+            code = -os.WTERMSIG(status)
+          else:
+            code = os.WEXITSTATUS(status)
+          children.pop(pid, None)
+          cls._Send(sock, ('exit', pid, code))
+      if sock_fd not in ready:
+        continue
+      msg, fds = cls._Recv(sock)
+      if msg is None:
+        break
+      if msg[0] == 'spawn':
+        _, args, shell, executable, stdin, pin, has_fds = msg
+        in_fd, out_fd, err_fd = [fds.pop(0) if x else None for x in has_fds]
+        try:
+          child = Placement.Launch(pin, SpawnedProcess, args, shell=shell,
+                                   executable=executable, sigdef=sigdef,
+                                   stdin=stdin, in_fd=in_fd, out_fd=out_fd,
+                                   err_fd=err_fd)
+        except OSError as exc:
+          cls._Send(sock, ('error', exc.errno, exc.strerror))
+          continue
+        finally:
+          for fd in (in_fd, out_fd, err_fd):
+            if fd is not None:
+              os.close(fd)
+        files = [x for x in (child.stdout, child.stderr, child.stdin) if x]
+        cls._Send(sock, ('spawned', child.pid), [x.fileno() for x in files])
+        for fileobj in files:
+          fileobj.close()
+        children[child.pid] = child
+      elif msg[0] == 'signal':
+        _, pid, sig = msg
+        if pid in children:
+          KillGroup(pid, sig)
+
+  def _Handle(self, msg):
+    """Handle an unsolicited message; return True if it's an exit."""
+    if msg and msg[0] == 'exit':
+      _, pid, code = msg
+      self.codes[pid] = code
+      self.exited.append(pid)
+      return True
+    return False
+
+  def Spawn(self, args, shell=False, executable=None, stdin=False,
+            pin=None, in_fd=None, out_fd=None, err_fd=None):
+    """Launch a process; return (pid, stdout fd, stderr fd, stdin fd).
+
+    Given in_fd, out_fd, or err_fd, the process uses that instead of a pipe
+    (and the corresponding fd returned is None).
+    """
     # pylint: disable=too-many-arguments
+    if self.dead:
+      raise OSError(errno.EPIPE, 'launcher helper exited')
+    given = (in_fd, out_fd, err_fd)
+    passed = [x for x in given if x is not None]
+    self._Send(self.sock, ('spawn', args, shell, executable, stdin, pin,
+                           [x is not None for x in given]), passed)
+    while True:
+      msg, fds = self._Recv(self.sock)
+      if msg is None:
+        raise OSError(errno.EPIPE, 'launcher helper exited')
+      if self._Handle(msg):
+        continue
+      if msg[0] == 'error':
+        raise OSError(msg[1], msg[2])
+      out_r = fds.pop(0) if out_fd is None else None
+      err_r = fds.pop(0) if err_fd is None else None
+      return msg[1], out_r, err_r, fds[0] if stdin and in_fd is None else None
+
+  def Signal(self, pid, sig):
+    """Signal a process, if it hasn't been reaped."""
+    if not self.dead:
+      self._Send(self.sock, ('signal', pid, sig))
+
+  def Receive(self):
+    """Collect any available exit reports; return False if helper exited."""
+    while select.select([self.fd], [], [], 0)[0]:
+      msg, _ = self._Recv(self.sock)
+      if msg is None:
+        self.dead = True
+        return False
+      self._Handle(msg)
+    return True
+
+  def Lost(self, pids, kill=False):
+    """Fail processes whose exits will never be reported, maybe killing."""
+    # Only kill them if they're now our orphans (as subreaper), since then
+    # they're not yet reaped, and their pids are still theirs
+    for pid in pids:
+      if pid not in self.codes:
+        if kill:
+          KillGroup(pid, signal.SIGKILL)
+        self.codes[pid] = -signal.SIGKILL
+        self.exited.append(pid)
+
+  def Wait(self, pid):
+    """Wait for a process's exit report; return exit code."""
+    while pid not in self.codes:
+      msg, _ = self._Recv(self.sock)
+      if msg is None:
+        raise OSError(errno.EPIPE, 'launcher helper exited')
+      self._Handle(msg)
+    return self.codes[pid]
+
+  def TakeExits(self):
+    """Get pids reported as exited since last call."""
+    exited = self.exited
+    self.exited = []
+    return exited
+
+  def Close(self):
+    """Shut down the helper."""
+    self.sock.close()
+    os.waitpid(self.pid, 0)
+
+
+class ZygoteProcess(object):
+  """Minimal subprocess.Popen work-alike for processes from a Zygote."""
+
+  def __init__(self, zygote, args, shell=False, executable=None,
+               stdin=False, pin=None, in_fd=None, out_fd=None, err_fd=None):
+    # pylint: disable=too-many-arguments
+    self.zygote = zygote
+    self.returncode = None
+    self.stdin = self.stdout = self.stderr = None
+    self.pid, out_r, err_r, in_w = zygote.Spawn(
+        args, shell=shell, executable=executable, stdin=stdin, pin=pin,
+        in_fd=in_fd, out_fd=out_fd, err_fd=err_fd)
+    if in_w is not None:
+      self.stdin = os.fdopen(in_w, 'wb', 0)
+    if out_r is not None:
+      self.stdout = os.fdopen(out_r, 'rb', 0)
+    if err_r is not None:
+      self.stderr = os.fdopen(err_r, 'rb', 0)
+
+  def poll(self):
+    """Check for reported exit; return exit code or None."""
+    if self.returncode is None:
+      self.returncode = self.zygote.codes.pop(self.pid, None)
+    return self.returncode
+
+  def wait(self):
+    """Wait for exit; return exit code."""
+    if self.returncode is None:
+      self.zygote.Wait(self.pid)
+    return self.poll()
+
+  def send_signal(self, sig):
+    """Send a signal, unless already reported as exited."""
+    if self.returncode is None and self.pid not in self.zygote.codes:
+      self.zygote.Signal(self.pid, sig)
+
+  def kill(self):
+    """Kill the process."""
+    self.send_signal(signal.SIGKILL)
+
+
+class Job(object):
+  """Class for a unit of work and its output."""
+  # Once more than this much output is held in memory across all jobs, a
+  # job adding to it moves its own to an unlinked temporary file shared by
+  # all jobs, as (iserr, time, length) headers, each followed by its data.
+  # Each job notes the (offset, length) extents it has there, and the file
+  # is emptied whenever none are left.
+  SPILL_AT = None  # Set by main()
+  SPILL_HEADER = struct.Struct('=BdI')
+  SPILL_BATCH = 1 << 20
+  held = 0  # Bytes of output held in memory, across all jobs
+  spill_file = None
+  spill_live = 0  # Bytes in spill_file not yet printed or discarded
+
+  def __init__(self, name):
     self.name = name
     self.realname = name
     if not name:
       self.name = '(command)'
-    # Dummy input pipe
-    self.input = subprocess.PIPE
-    # Need piped output for ^C to be delivered here
-    self.output = subprocess.PIPE
-    self.errout = subprocess.PIPE
+    self.ret = None
+    self.item = None
+    self.host = None
+    self.slot = None
+    self.cgroup = None
+    self.usage = None  # (peak memory, CPU seconds) from the cgroup
+    self.count = 1  # Number of items
+    self.attempt = 1
+    self.timer = None  # Timeout, if any
+    self.timed_out = False
+    self.pipeline = None  # With --then, the item's Pipeline
+    self.stage = 0
+    self.seq = None  # The item's number in start order, e.g. for -k
+    self.results = None  # With --results, the item's directory
+    self.started = time.time()
+    self.finished = None
+    self.outdata = []  # (iserr, time, whole lines) chunks
+    self.outsize = 0
+    self.spilled = []  # (offset, length) of earlier chunks in spill_file
+    self.partial = [b'', b'']
+    self.tags = None  # Cached line prefixes
+
+  def ClosePipes(self):
+    """Release anything but buffered output (nothing, by default)."""
+
+  def Close(self):
+    """Release buffered output."""
+    self._Drop()
+    self._Unspilled()
+    self.partial = [b'', b'']
+
+  def AttemptStr(self):
+    """Return the attempt count for reports, if retried."""
+    return ' (%d attempts)' % self.attempt if self.attempt > 1 else ''
+
+  def ResultStr(self):
+    """Return name=ret for reports."""
+    return '%s=%d%s' % (self.name, self.ret, self.AttemptStr())
+
+  def _AddOutput(self, iserr, data):
+    if not data:
+      return False
+    # Keep whole lines as one chunk, with one timestamp per read
+    cut = data.rfind(b'\n') + 1
+    if not cut:
+      self.partial[iserr] += data
+      return True
+    self._Keep(iserr, time.time(), self.partial[iserr] + data[:cut])
+    self.partial[iserr] = data[cut:]
+    return True
+
+  def _AddLines(self, iserr, lines, tstamp):
+    if lines:
+      self._Keep(iserr, tstamp, b'\n'.join(lines) + b'\n')
+
+  def _Drop(self):
+    """Forget the output held in memory."""
+    Job.held -= self.outsize
+    self.outdata = []
+    self.outsize = 0
+
+  def _Keep(self, iserr, tstamp, data):
+    """Hold a chunk of output, spilling it all to disk if it's too much."""
+    self.outdata.append((iserr, tstamp, data))
+    self.outsize += len(data)
+    Job.held += len(data)
+    if self.SPILL_AT is None or Job.held <= self.SPILL_AT:
+      return
+    if not Job.spill_file:
+      Job.spill_file = tempfile.TemporaryFile(prefix='apply-')
+    spill = Job.spill_file
+    spill.seek(0, os.SEEK_END)
+    start = spill.tell()
+    header = self.SPILL_HEADER
+    for chunk in self.outdata:
+      spill.write(header.pack(chunk[0], chunk[1], len(chunk[2])))
+      spill.write(chunk[2])
+    length = spill.tell() - start
+    if self.spilled and sum(self.spilled[-1]) == start:
+      self.spilled[-1] = (self.spilled[-1][0], self.spilled[-1][1] + length)
+    else:
+      self.spilled.append((start, length))
+    Job.spill_live += length
+    self._Drop()
+
+  def _Unspilled(self):
+    """Release our extents of the spill file, emptying it if unused."""
+    Job.spill_live -= sum([x[1] for x in self.spilled])
+    self.spilled = []
+    if not Job.spill_live and Job.spill_file:
+      Job.spill_file.seek(0)
+      Job.spill_file.truncate()
+
+  def _Unspill(self):
+    """Yield batches of spilled chunks, in order, releasing them."""
+    header = self.SPILL_HEADER
+    spill = Job.spill_file
+    spill.flush()
+    batch = []
+    size = 0
+    for pos, length in self.spilled:
+      end = pos + length
+      while pos < end:
+        # Seek each time, since other jobs may spill between batches
+        spill.seek(pos)
+        iserr, tstamp, length = header.unpack(spill.read(header.size))
+        batch.append((iserr, tstamp, spill.read(length)))
+        pos += header.size + length
+        size += length
+        if size >= self.SPILL_BATCH:
+          yield batch
+          batch = []
+          size = 0
+    if batch:
+      yield batch
+    self._Unspilled()
+
+  def _Tags(self, name, tstamp):
+    """Get per-stream line prefixes, or the name part if timestamped."""
+    if self.tags is None:
+      bname = FSEncode(self.name)
+      self.tags = ([bname + x for x in TAG_SEPS], bname + b' @')
+    if tstamp:
+      return self.tags[1] if name else b''
+    return self.tags[0]
+
+  def _Write(self, chunks, name, tstamp, where):
+    """Write output chunks, tagging each line if asked."""
+    tagged = name or tstamp
+    tags = tagged and self._Tags(name, tstamp)
+    run = []
+    runerr = None
+    for iserr, when, data in chunks:
+      if tagged:
+        if tstamp:
+          prefix = b''.join([tags, Stamper.Get(when), TAG_SEPS[iserr]])
+        else:
+          prefix = tags[iserr]
+        data = b''.join([prefix, data[:-1].replace(b'\n', b'\n' + prefix),
+                         b'\n'])
+      if iserr != runerr and run:
+        WriteBytes(where[runerr], b''.join(run))
+        run = []
+      runerr = iserr
+      run.append(data)
+    if run:
+      WriteBytes(where[runerr], b''.join(run))
+
+  def Print(self, name=False, tstamp=False, where=(sys.stdout, sys.stderr)):
+    """Print results with optional name and/or timestamp."""
+    if self.spilled:
+      for batch in self._Unspill():
+        self._Write(batch, name, tstamp, where)
+    if self.outdata:
+      self._Write(self.outdata, name, tstamp, where)
+    self._Drop()
+
+  def PrintLast(self, name=None, tstamp=False, where=(sys.stdout, sys.stderr)):
+    """Print partial line with optional name and/or timestamp."""
+    now = time.time()
+    self._Write([(x, now, self.partial[x] + b'\n')
+                 for x in range(2) if self.partial[x]], name, tstamp, where)
+
+
+class Process(Job):  # pylint: disable=too-many-instance-attributes
+  """Class for subprocesses."""
+  # Assumes the command won't expect input via stdin, unless asked
+  CHUNK = 65536
+  USE_SPAWN = hasattr(os, 'posix_spawnp')
+  # With nothing to add to the output, main() sets this to pass it straight
+  # through: 'splice' when only one job ever runs at once, else 'copy' to
+  # write whole lines via one reused buffer
+  PASSTHROUGH = None
+  PASS_BUFFER = bytearray(CHUNK)
+  PASS_VIEW = memoryview(PASS_BUFFER)
+  SPLICE_MAX = 1 << 20
+  # Puts each job in its own process group, like posix_spawn's setpgroup
+  if sys.version_info >= (3, 11):
+    POPEN_GROUP = {'process_group': 0}
+  else:
+    POPEN_GROUP = {'preexec_fn': os.setpgrp}
+
+  def __init__(self, name, args, shell=False, zygote=None, stdin=False,
+               pin=None, in_fd=None, out_fd=None, err_fd=None):
+    # pylint: disable=too-many-arguments
+    Job.__init__(self, name)
+    # Dummy input pipe, unless given an fd (which the caller closes)
+    self.input = subprocess.PIPE if in_fd is None else in_fd
+    # Need piped output for ^C to be delivered here, unless given an fd
+    self.output = subprocess.PIPE if out_fd is None else out_fd
+    self.errout = subprocess.PIPE if err_fd is None else err_fd
     self.shell = shell
     if shell:
       self.args = ShellStr(args)
@@ -327,106 +1435,607 @@ class Process(object):  # pylint: disable=too-many-instance-attributes
     else:
       self.args = args
       self.executable = None
-    self.ret = None
-    self.finished = None
-    self.outdata = []
-    self.partial = [b'', b'']
-    # Python >=3.8 doesn't like line-buffered binary, so use unbuffered
-    self.proc = subprocess.Popen(
-        self.args, bufsize=0, shell=self.shell, executable=self.executable,
-        stdin=self.input, stdout=self.output, stderr=self.errout
-        )
+    if zygote:
+      self.proc = ZygoteProcess(zygote, self.args, shell=self.shell,
+                                executable=self.executable, stdin=stdin,
+                                pin=pin, in_fd=in_fd, out_fd=out_fd,
+                                err_fd=err_fd)
+    elif self.USE_SPAWN:
+      self.proc = Placement.Launch(
+          pin, SpawnedProcess, self.args, shell=self.shell,
+          executable=self.executable, stdin=stdin, in_fd=in_fd,
+          out_fd=out_fd, err_fd=err_fd)
+    else:
+      # Python >=3.8 doesn't like line-buffered binary, so use unbuffered
+      self.proc = Placement.Launch(
+          pin, subprocess.Popen,
+          self.args, bufsize=0, shell=self.shell, executable=self.executable,
+          stdin=self.input, stdout=self.output, stderr=self.errout,
+          **self.POPEN_GROUP)
     self.started = time.time()
-    # Since we don't currently handle input, close the input pipe immediately.
-    self.proc.stdin.close()
-    self._SetBothNonblocking(True)
-
-  def _SetBothNonblocking(self, nonblock):
-    self._SetNonblocking(self.proc.stdout, nonblock)
-    self._SetNonblocking(self.proc.stderr, nonblock)
-
-  @staticmethod
-  def _SetNonblocking(fileobj, nonblock):
-    ofl = fcntl.fcntl(fileobj, fcntl.F_GETFL)
-    newflag = ofl | os.O_NONBLOCK if nonblock else ofl & ~os.O_NONBLOCK
-    fcntl.fcntl(fileobj, fcntl.F_SETFL, newflag)
+    # Unless wanted, close the input pipe immediately.
+    if self.proc.stdin and not stdin:
+      self.proc.stdin.close()
+      self.proc.stdin = None
+    self.fds = [x and x.fileno() for x in (self.proc.stdout, self.proc.stderr)]
+    self.open = [x is not None for x in self.fds]
+    self.poller = None
+    self.pidfd = None
+    for fd, _ in self.Fds():
+      SetNonblocking(fd, True)
 
   def Register(self, poller):
     """Register pipe(s) with poll object."""
-    poller.register(self.proc.stdout, poller.POLLIN)
-    poller.register(self.proc.stderr, poller.POLLIN)
+    self.poller = poller
+    for fd, _ in self.Fds():
+      poller.register(fd, poller.POLLIN)
 
-  def Unregister(self, poller):
-    """Unregister pipe(s) with poll object."""
-    poller.unregister(self.proc.stdout)
-    poller.unregister(self.proc.stderr)
+  def Unregister(self):
+    """Unregister any still-open pipe(s) with poll object."""
+    for iserr in range(2):
+      self._EndStream(iserr)
+    self.poller = None
+
+  def Fds(self):
+    """Get (fd, iserr) for each still-open pipe."""
+    return [(fd, iserr) for iserr, fd in enumerate(self.fds)
+            if self.open[iserr]]
+
+  def _EndStream(self, iserr):
+    if self.open[iserr] and self.poller:
+      self.poller.unregister(self.fds[iserr])
+    self.open[iserr] = False
+
+  def ClosePipes(self):
+    """Release pipes of a finished subprocess, keeping its output."""
+    if self.proc.stdin:
+      self.proc.stdin.close()
+    if self.proc.stdout:
+      self.proc.stdout.close()
+    if self.proc.stderr:
+      self.proc.stderr.close()
+
+  def Close(self):
+    """Release pipes and buffered output of a finished subprocess."""
+    self.ClosePipes()
+    Job.Close(self)
 
   def _GetOutput(self, iserr=0):
-    stream = self.proc.stderr if iserr else self.proc.stdout
+    """Read available output from one pipe; return None at EOF."""
     # Note that file iterators don't work properly with nonblocking I/O
-    # in Python 2, so we need to do read() and split().
+    # in Python 2, and file read() can't distinguish EOF from no data in
+    # Python 3, so we use os.read() and split().
+    if self.PASSTHROUGH:
+      return self._PassOutput(iserr)
     try:
-      data = stream.read()
-    except IOError:
-      return False
+      data = os.read(self.fds[iserr], self.CHUNK)
+    except OSError as exc:
+      if exc.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+        return False
+      raise
+    if not data:
+      return None
     return self._AddOutput(iserr, data)
 
-  def _AddOutput(self, iserr, data):
-    if not data:
-      return False
-    lines = data.split(b'\n')
-    if self.partial[iserr]:
-      self.partial[iserr] += lines[0]
-      del lines[0]
-      if lines:
-        self.outdata.append(Line(iserr, self.partial[iserr]))
+  def _PassOutput(self, iserr):
+    """Pass output from one pipe straight to ours; return None at EOF."""
+    fd = self.fds[iserr]
+    out = (sys.stdout, sys.stderr)[iserr]
+    out.flush()  # Anything printed goes first
+    if self.PASSTHROUGH == 'splice':
+      return self._Splice(iserr, fd, out.fileno())
+    try:
+      count = ReadInto(fd, self.PASS_VIEW)
+    except OSError as exc:
+      if exc.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+        return False
+      raise
+    if not count:
+      return None
+    # Hold back any partial line, so that jobs' lines can't be mixed
+    cut = self.PASS_BUFFER.rfind(b'\n', 0, count) + 1
+    if cut:
+      if self.partial[iserr]:
+        WriteAll(out.fileno(), self.partial[iserr])
         self.partial[iserr] = b''
-      else:
-        return True
-    if lines[-1]:
-      self.partial[iserr] = lines[-1]
-    del lines[-1]
-    for line in lines:
-      self.outdata.append(Line(iserr, line))
+      WriteAll(out.fileno(), self.PASS_VIEW[:cut])
+    self.partial[iserr] += self.PASS_VIEW[cut:count].tobytes()
     return True
 
-  def _GetBothOutputs(self):
-    return self._GetOutput(0) or self._GetOutput(1)
+  def _Splice(self, iserr, fd, out_fd):
+    """Move output from one pipe to ours in the kernel."""
+    # All but the last byte available, which we read to see whether it ends
+    # a line, holding it back if not, as in copy mode, so that PrintLast()
+    # can end the job's last line
+    left = min(PipeAvailable(fd), self.SPLICE_MAX) - 1
+    if left > 0 and self.partial[iserr]:
+      WriteAll(out_fd, self.partial[iserr])
+      self.partial[iserr] = b''
+    while left > 0:
+      try:
+        # pylint: disable=no-member
+        left -= os.splice(fd, out_fd, left)
+      except OSError as exc:
+        if exc.errno == errno.EINVAL:
+          # Our output can't take it (e.g., a tty or an O_APPEND file)
+          Process.PASSTHROUGH = 'copy'
+          return self._PassOutput(iserr)
+        if exc.errno not in (errno.EAGAIN, errno.EWOULDBLOCK):
+          raise
+        select.select([], [out_fd], [])  # Our output is full
+    try:
+      data = os.read(fd, 1)
+    except OSError as exc:
+      if exc.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+        return False
+      raise
+    if not data:
+      return None
+    if data == b'\n':
+      WriteAll(out_fd, self.partial[iserr] + data)
+      self.partial[iserr] = b''
+    else:
+      self.partial[iserr] += data
+    return True
 
   def _AddBothOutputs(self, out, err):
     self._AddOutput(0, out)
     self._AddOutput(1, err)
 
+  def Read(self, iserr):
+    """Read from a ready pipe; return True if output was added."""
+    ret = self._GetOutput(iserr)
+    if ret is None:
+      self._EndStream(iserr)
+      return False
+    return ret
+
   def Poll(self):
-    """Poll subprocess for activity; return False, True, or exit code."""
+    """Check subprocess for exit; return None if running, else exit code."""
     if self.proc.poll() is None:
-      return self._GetBothOutputs()
+      return None
     self.finished = time.time()
-    self._SetBothNonblocking(False)
-    self._GetBothOutputs()
+    # Collect what's left, but don't wait on pipes held open by descendants
+    for _, iserr in self.Fds():
+      while self.Read(iserr):
+        pass
     return self.proc.returncode
 
+  def Signal(self, sig):
+    """Send signal to subprocess, and the rest of its process group."""
+    if isinstance(self.proc, subprocess.Popen):
+      if self.proc.returncode is None:
+        KillGroup(self.proc.pid, sig)
+    else:
+      self.proc.send_signal(sig)
+
+  def Kill(self):
+    """Kill subprocess, and the rest of its process group."""
+    self.Signal(signal.SIGKILL)
+
+
+class WorkItem(Job):
+  """Class for an item handled by a Worker."""
+
+  def __init__(self, item):
+    Job.__init__(self, ItemName(item))
+    self.item = item  # pylint: disable=redefined-variable-type
+
+
+class Worker(Process):
+  """Class for a persistent subprocess fed items via stdin."""
+  # Each item is written as a line (or NUL-terminated), and its response is
+  # either one line of output, or all output up to a line matching "end"
+  # (which isn't shown).  Stderr goes with the current item.
+  PASSTHROUGH = None  # Output has to be split up by item
+
+  def __init__(self, name, args, shell=False, zygote=None, end=None,
+               null=False, pin=None):
+    # pylint: disable=too-many-arguments
+    Process.__init__(self, name, args, shell=shell, zygote=zygote,
+                     stdin=True, pin=pin)
+    self.end = None if end is None else end.encode('latin-1')
+    self.sep = b'\0' if null else b'\n'
+    self.current = None
+    self.completed = []
+    self.linebuf = b''
+    self.unsent = b''  # Input not yet taken by the worker
+    self.ending = False  # Input to be closed once sent
+    SetNonblocking(self.proc.stdin, True)
+
+  def Idle(self):
+    """Check whether the worker is ready for another item."""
+    return self.current is None and self.proc.stdin is not None
+
+  def InFd(self):
+    """Get the fd that items are written to."""
+    return self.proc.stdin.fileno()
+
+  def Send(self, item):
+    """Give the worker an item, to be written by Flush(); return its job."""
+    self.current = job = WorkItem(item)
+    self.unsent += FSEncode(item) + self.sep
+    return job
+
+  def Flush(self):
+    """Write as much unsent input as fits; return True if all sent."""
+    try:
+      while self.unsent:
+        self.unsent = self.unsent[os.write(self.InFd(), self.unsent):]
+    except OSError as exc:
+      if exc.errno == errno.EPIPE:
+        self.unsent = b''  # It's exiting, and the exit will fail the item
+      elif exc.errno != errno.EAGAIN:
+        raise
+    return not self.unsent
+
+  def EndInput(self):
+    """Tell the worker there are no more items, once it has the rest."""
+    self.ending = True
+    if self.proc.stdin and not self.unsent:
+      self.proc.stdin.close()
+      self.proc.stdin = None
+
+  def _AddOutput(self, iserr, data):
+    if not data:
+      return False
+    if iserr or not self.current:
+      return Job._AddOutput(self.current or self, iserr, data)
+    tstamp = time.time()
+    lines = (self.linebuf + data).split(b'\n')
+    self.linebuf = lines.pop()
+    # Gather each item's lines into one chunk
+    taken = []
+    for line in lines:
+      job = self.current
+      if not job:
+        taken.append(line)
+        continue
+      if self.end is None or line != self.end:
+        taken.append(line)
+      if self.end is None or line == self.end:
+        job._AddLines(0, taken, tstamp)  # pylint: disable=protected-access
+        taken = []
+        self._EndItem(0)
+    (self.current or self)._AddLines(  # pylint: disable=protected-access
+        0, taken, tstamp)
+    return True
+
+  def _EndItem(self, ret):
+    job = self.current
+    job.ret = ret
+    job.finished = time.time()
+    self.completed.append(job)
+    self.current = None
+
+  def TakeCompleted(self):
+    """Get jobs completed since last call."""
+    completed = self.completed
+    self.completed = []
+    return completed
+
+  def FailCurrent(self, ret):
+    """Fail the current item, if any, after exit."""
+    if self.current:
+      self.current.partial[0] = self.linebuf
+      self.linebuf = b''
+      self._EndItem(ret or 1)
+
   def Print(self, name=False, tstamp=False, where=(sys.stdout, sys.stderr)):
-    """Print results with optional name and/or timestamp."""
-    for line in self.outdata:
-      line.Print(name=name and self.name, tstamp=tstamp, where=where)
-    self.outdata = []
+    """Print results, including the current item's."""
+    Job.Print(self, name=name, tstamp=tstamp, where=where)
+    if self.current:
+      self.current.Print(name=name, tstamp=tstamp, where=where)
+
+
+class ArgReader(object):
+  """Reader for argument lines, which never blocks unless asked to."""
+  CHUNK = 65536
+
+  def __init__(self, fileobj):
+    self.fileobj = fileobj  # Keep open
+    self.fd = fileobj.fileno()
+    self.regular = stat.S_ISREG(os.fstat(self.fd).st_mode)
+    self.partial = b''
+    self.eof = False
+
+  def Read(self, block=False):
+    """Read available lines; return None if none are available yet."""
+    if self.eof:
+      return []
+    if not self.regular and not block:
+      if not select.select([self.fd], [], [], 0)[0]:
+        return None
+    data = os.read(self.fd, self.CHUNK)
+    if not data:
+      self.eof = True
+      lines = [self.partial] if self.partial else []
+      self.partial = b''
+    else:
+      lines = (self.partial + data).split(b'\n')
+      self.partial = lines.pop()
+    return [FSDecode(x.rstrip()) for x in lines]
+
+  def AtEnd(self):
+    """Check whether everything written so far has been read."""
+    # Only a hint for regular files, which may still be appended to
+    if self.eof:
+      return True
+    if not self.regular:
+      return False
+    try:
+      return os.lseek(self.fd, 0, os.SEEK_CUR) >= os.fstat(self.fd).st_size
+    except OSError:
+      return False
 
-  def PrintLast(self, name=None, tstamp=False, where=(sys.stdout, sys.stderr)):
-    """Print partial line with optional name and/or timestamp."""
-    for iserr in range(2):
-      if self.partial[iserr]:
-        print(Line.Format(self.partial[iserr],
-                          iserr, name and self.name, tstamp and time.time()),
-              file=where[iserr])
 
-  def Signal(self, sig):
-    """Send signal to subprocess."""
-    self.proc.send_signal(sig)
+class ItemSource(object):
+  """Lazily consumed queue of items, with total count as known so far."""
 
-  def Kill(self):
-    """Kill subprocess."""
-    self.proc.kill()
+  def __init__(self, items=(), reader=None):
+    self.reader = reader
+    self.queue = collections.deque(items)
+    self.taken = 0
+    self.exhausted = reader is None
+    self.skip = None
+    self.skipped = 0
+
+  def Filter(self, skip):
+    """Drop items, now and as read, for which skip(item) is true."""
+    self.skip = skip
+    self.queue = collections.deque(self._Filtered(self.queue))
+
+  def _Filtered(self, items):
+    if not self.skip:
+      return items
+    result = [x for x in items if not self.skip(x)]
+    self.skipped += len(items) - len(result)
+    return result
+
+  def __bool__(self):
+    return self.Fill()
+
+  __nonzero__ = __bool__  # Python 2
+
+  def Fill(self, block=False):
+    """Try to have at least one item queued; return True if so."""
+    while not self.queue:
+      if self.exhausted:
+        return False
+      if self.reader:
+        lines = self.reader.Read(block)
+        if lines is None:
+          return False
+        self.queue.extend(self._Filtered(lines))
+        if self.reader.eof and not self.queue:
+          self.exhausted = True
+    return True
+
+  def TakeAll(self):
+    """Read and take all remaining items, waiting as needed."""
+    while self.reader and not self.exhausted:
+      lines = self.reader.Read(block=True)
+      self.queue.extend(self._Filtered(lines))
+      if self.reader.eof:
+        self.exhausted = True
+    items = list(self.queue)
+    self.queue.clear()
+    self.reader = None
+    return items
+
+  def AtEnd(self):
+    """Check whether all remaining items are (probably) queued."""
+    return not self.reader or self.reader.AtEnd()
+
+  def Available(self):
+    """Get the number of items queued."""
+    return len(self.queue)
+
+  def Peek(self):
+    """Get the next item without consuming it; raises IndexError if none."""
+    if not self.Fill():
+      raise IndexError('no more items')
+    return self.queue[0]
+
+  def Waiting(self):
+    """Get the input fd if we're waiting for it, else None."""
+    if self.reader and not self.queue and not self.exhausted:
+      return self.reader.fd
+    return None
+
+  def Next(self):
+    """Get the next item; raises IndexError if none."""
+    if not self.Fill():
+      raise IndexError('no more items')
+    self.taken += 1
+    return self.queue.popleft()
+
+  def Clear(self):
+    """Discard all remaining items."""
+    self.queue.clear()
+    self.reader = None
+    self.exhausted = True
+
+  def Total(self):
+    """Get total item count, as known so far."""
+    return self.taken + len(self.queue)
+
+  def TotalKnown(self):
+    """Check whether Total() is final, i.e., all input has been read."""
+    return self.exhausted
+
+  def TotalStr(self):
+    """Get total item count, with '+' if more may follow."""
+    if self.TotalKnown():
+      return '%d' % self.Total()
+    return '%d+' % self.Total()
+
+  def Done(self, job):  # pylint: disable=no-self-use,unused-argument
+    """Note a finished job; return (item, cause) for any items dropped."""
+    return []
+
+
+class DagSource(ItemSource):
+  """Items with dependencies, released as their dependencies succeed."""
+  # Each line is an item, optionally followed by "<-" and the names of the
+  # items it needs, where an item's name is its first word.  Ready items
+  # with the longest path of dependents go first, to start the critical
+  # path early.
+  DEP_SEP = '<-'
+
+  def __init__(self, lines, estimator=None):
+    ItemSource.__init__(self)
+    self.queue = []  # Heap of (-path length, line number, item)
+    self.items = collections.OrderedDict()  # name -> item
+    deps = {}
+    for line in lines:
+      words = line.split()
+      if not words:
+        continue
+      item, needs = line, None
+      if self.DEP_SEP in words:
+        pos = words.index(self.DEP_SEP)
+        item, needs = ' '.join(words[:pos]), set(words[pos + 1:])
+      if not item:
+        raise DependencyError('no item before %s: %s' % (self.DEP_SEP, line))
+      try:
+        name = self.Name(item)
+      except ValueError as exc:
+        raise DependencyError('%s: %s' % (exc, line))
+      if name in self.items:
+        raise DependencyError('duplicate item name %s' % name)
+      self.items[name] = item
+      if needs is not None:
+        deps[name] = needs
+    self.dependents = dict([(x, []) for x in self.items])
+    for name, needs in deps.items():
+      for dep in sorted(needs):
+        if dep not in self.items:
+          raise DependencyError('%s depends on unknown item %s' % (name, dep))
+        self.dependents[dep].append(name)
+    self.waiting = dict([(x, len(deps.get(x, ()))) for x in self.items])
+    self.order = self._Order()
+    weight = (estimator(list(self.items.values())) if estimator
+              else (lambda _: 1))
+    self.height = {}
+    for name in reversed(self.order):
+      self.height[name] = weight(self.items[name]) + max(
+          [self.height[x] for x in self.dependents[name]] or [0])
+    self.index = dict([(x, i) for i, x in enumerate(self.items)])
+    self.satisfied = set()  # Done before, per Filter()
+    self.dropped = set()
+    self.blocked = len(self.items)
+    self.total = len(self.items)
+    for name in self.order:
+      if not self.waiting[name]:
+        self._Release(name)
+
+  def _Order(self):
+    """Get the names in topological order; raise DependencyError if cyclic."""
+    waiting = dict(self.waiting)
+    order = [x for x in self.items if not waiting[x]]
+    for name in order:  # Grows as we go
+      for dependent in self.dependents[name]:
+        waiting[dependent] -= 1
+        if not waiting[dependent]:
+          order.append(dependent)
+    if len(order) < len(self.items):
+      cyclic = [x for x in self.items if waiting[x]]
+      raise DependencyError('dependency cycle among %s' % ', '.join(cyclic))
+    return order
+
+  @staticmethod
+  def Name(item):
+    """Get an item's name, as for ItemName()."""
+    return FirstWord(item)
+
+  def _Release(self, name):
+    if name in self.satisfied:
+      return
+    heapq.heappush(self.queue, (-self.height[name], self.index[name],
+                                self.items[name]))
+    self.blocked -= 1
+    self.exhausted = not self.blocked
+
+  def _Succeeded(self, name):
+    for dependent in self.dependents[name]:
+      self.waiting[dependent] -= 1
+      if not self.waiting[dependent]:
+        self._Release(dependent)
+
+  def _Failed(self, name):
+    """Drop everything depending on a failed item; return the dropped."""
+    result = []
+    stack = [name]
+    while stack:
+      for dependent in self.dependents[stack.pop()]:
+        if dependent in self.dropped or dependent in self.satisfied:
+          continue
+        self.dropped.add(dependent)
+        self.blocked -= 1
+        result.append((self.items[dependent], name))
+        stack.append(dependent)
+    self.exhausted = not self.blocked
+    return result
+
+  def Filter(self, skip):
+    """Treat items for which skip(item) is true as already successful."""
+    self.satisfied = set([x for x in self.items if skip(self.items[x])])
+    self.skipped = len(self.satisfied)
+    self.total -= self.skipped
+    queued = set([self.Name(x[2]) for x in self.queue])
+    self.blocked -= len(self.satisfied - queued)
+    self.queue = [x for x in self.queue
+                  if self.Name(x[2]) not in self.satisfied]
+    heapq.heapify(self.queue)
+    for name in self.order:
+      if name in self.satisfied:
+        self._Succeeded(name)
+    self.exhausted = not self.blocked
+
+  def Fill(self, block=False):
+    return bool(self.queue)
+
+  def TakeAll(self):
+    items = [x[2] for x in sorted(self.queue)]
+    self.queue = []
+    return items
+
+  def Peek(self):
+    if not self.queue:
+      raise IndexError('no more items')
+    return self.queue[0][2]
+
+  def Next(self):
+    if not self.queue:
+      raise IndexError('no more items')
+    self.taken += 1
+    return heapq.heappop(self.queue)[2]
+
+  def Clear(self):
+    self.queue = []
+    self.blocked = 0
+    self.exhausted = True
+
+  def Total(self):
+    return self.total
+
+  @staticmethod
+  def TotalKnown():
+    return True  # All read up front
+
+  def TotalStr(self):
+    return '%d' % self.total
+
+  def Done(self, job):
+    items = job.item if isinstance(job.item, list) else [job.item]
+    dropped = []
+    for item in items:
+      if job.ret:
+        dropped.extend(self._Failed(self.Name(item)))
+      else:
+        self._Succeeded(self.Name(item))
+    return dropped
 
 
 def SplitArgs(arglist):
@@ -466,6 +2075,9 @@ def ParseArgs(prog, args):
       )
   parser.add_argument('-s', '--sequential', action='store_true',
                       help='report output sequentially per process')
+  parser.add_argument('-k', '--keep-order', action='store_true',
+                      help='report output in the order items started,'
+                      ' showing only the earliest unfinished one live')
   parser.add_argument('-n', '--names', action='store_true',
                       help='tag output lines with item names')
   parser.add_argument('-t', '--times', action='store_true',
@@ -479,14 +2091,87 @@ def ParseArgs(prog, args):
                        help='arguments (paths)')
   argopts.add_argument('-f', '--arg-file', type=argparse.FileType(mode='r'),
                        help='file containing argument lines')
-  argopts.add_argument('-m', '--machines', action='append',
-                       help='target machines (via ssh)')
+  parser.add_argument('-m', '--machines', action='append',
+                      help='target machines (via ssh)')
   parser.add_argument('-4', '--ipv4', action='store_true',
                       help="force IPv4 with -m's ssh")
   parser.add_argument('-6', '--ipv6', action='store_true',
                       help="force IPv6 with -m's ssh")
   parser.add_argument('-S', '--shell', action='store_true',
                       help='run with shell')
+  parser.add_argument('-j', '--jobs', type=int,
+                      help='maximum concurrent processes (0 = unlimited;'
+                      ' default: number of CPUs, unlimited with -m)')
+  parser.add_argument('--max-args', type=int,
+                      help='maximum items per command with %%@')
+  parser.add_argument('--max-chars', type=int,
+                      help='maximum command length with %%@')
+  parser.add_argument('--then', action='append', metavar='CMD',
+                      help='pipe each item\'s output into CMD, with the'
+                      ' same substitutions (repeatable, for more stages)')
+  parser.add_argument('--then-jobs', action='append', type=int, metavar='N',
+                      help='limit on items running each --then stage, in'
+                      ' order (default same as -j, which also limits items'
+                      ' in all stages together)')
+  parser.add_argument('--workers', type=int,
+                      help='feed items to this many persistent processes')
+  parser.add_argument('--worker-end', metavar='LINE',
+                      help="output line ending a worker's response"
+                      ' (default: each line is a response)')
+  parser.add_argument('-0', '--null', action='store_true',
+                      help='NUL-terminate items sent to workers')
+  parser.add_argument('--deps', action='store_true',
+                      help='-f lines may end with "<- name ..." to run only'
+                      ' after the items with those names (first words)'
+                      ' succeed')
+  parser.add_argument('--spill', type=ParseSize, default='16M',
+                      metavar='SIZE',
+                      help='with -s or -k, move held output to a'
+                      ' temporary file once past SIZE in all (default 16M)')
+  parser.add_argument('--history', metavar='FILE',
+                      help='record item durations in FILE, and run the'
+                      ' longest first')
+  parser.add_argument('--retries', type=int, default=0, metavar='N',
+                      help='rerun failed items up to N more times')
+  parser.add_argument('--retry-delay', type=float, default=1.0,
+                      metavar='SECS',
+                      help='delay before the first retry, doubled for each'
+                      ' later one (default 1)')
+  parser.add_argument('--timeout', type=float, metavar='SECS',
+                      help='stop items still running after SECS, via the'
+                      ' --ladder signals (counting as exit code 124, like'
+                      ' timeout(1))')
+  parser.add_argument('--ladder', type=ParseLadder, default='TERM,KILL@7',
+                      metavar='SIG[@SECS],...',
+                      help='signals for stopping processes, each SECS after'
+                      ' the first; after a terminating signal, the steps'
+                      ' after the first apply (default TERM,KILL@7)')
+  parser.add_argument('--halt', type=ParseHalt,
+                      metavar='{soon,now},fail={N,P%}',
+                      help='after N failed items, or P%% of all items'
+                      ' (checked once all are read), start no more (soon),'
+                      ' or also stop the running ones via --ladder (now)')
+  parser.add_argument('--joblog', metavar='FILE',
+                      help='append a record of each finished item to FILE')
+  parser.add_argument('--resume', action='store_true',
+                      help='skip items --joblog shows as successful')
+  parser.add_argument('--results', metavar='DIR',
+                      help="write each item's stdout and stderr (and the"
+                      ' item itself) to files in DIR/<name>, named by %%N,'
+                      ' %%0, or %%M')
+  parser.add_argument('--pin', choices=['cpu', 'node'],
+                      help='pin each job slot (see %%S) to one CPU, or to'
+                      ' the CPUs and memory of one NUMA node')
+  parser.add_argument('--cgroup', action='store_true',
+                      help='run each job in its own cgroup, reporting its'
+                      ' peak memory and CPU time with -v or -t')
+  parser.add_argument('--mem-max', type=ParseSize, metavar='SIZE',
+                      help='limit each job\'s memory (implies --cgroup)')
+  parser.add_argument('--cpu-max', type=float, metavar='CPUS',
+                      help='limit each job\'s CPU usage, in CPUs (implies'
+                      ' --cgroup)')
+  parser.add_argument('--zygote', action='store_true',
+                      help='launch via a helper process forked at startup')
   parser.add_argument('--signal-test', action='store_true',
                       help='enable signal-testing features')
   parser.add_argument('remaining', nargs=argparse.REMAINDER)
@@ -497,14 +2182,1270 @@ def ParseArgs(prog, args):
   return parser, parsed, args
 
 
+def ParseLadder(text):
+  """Parse a signal ladder like TERM,INT@5,KILL@10 into [(delay, signum)]."""
+  steps = []
+  for part in text.split(','):
+    name, _, delay = part.strip().partition('@')
+    name = name.upper()
+    if not name.startswith('SIG') and not name.isdigit():
+      name = 'SIG' + name
+    sig = int(name) if name.isdigit() else getattr(signal, name, None)
+    if not isinstance(sig, int) or sig <= 0:
+      raise argparse.ArgumentTypeError('unknown signal: %s' % part)
+    try:
+      delay = float(delay or 0)
+    except ValueError:
+      raise argparse.ArgumentTypeError('invalid delay: %s' % part)
+    if steps and delay < steps[-1][0]:
+      raise argparse.ArgumentTypeError('delays must not decrease: %s' % text)
+    steps.append((delay, sig))
+  return steps
+
+
+def ParseHalt(text):
+  """Parse a halt policy like now,fail=10 or soon,fail=5% into a tuple.
+
+  Returns:
+    (now, count, percent), with percent true if count is a percentage.
+  """
+  when, _, cond = text.partition(',')
+  kind, _, count = cond.partition('=')
+  percent = count.endswith('%')
+  if percent:
+    count = count[:-1]
+  try:
+    count = float(count) if percent else int(count)
+  except ValueError:
+    count = None
+  if when not in ('now', 'soon') or kind != 'fail' or not count or count < 0:
+    raise argparse.ArgumentTypeError('invalid halt policy: %s' % text)
+  return when == 'now', count, percent
+
+
+def DefaultJobs(parsed, pool=None):
+  """Get default process limit, with 0 meaning unlimited."""
+  if pool:
+    return pool.Capacity()
+  if parsed.machines:
+    return 0
+  try:
+    return cpu_count() or 1
+  except NotImplementedError:
+    return 1
+
+
+def ItemName(item):
+  """Get the name of an item or batch of items, or None."""
+  if isinstance(item, list):
+    name = ItemName(item[0])
+    if len(item) > 1:
+      name = '%s+%d' % (name, len(item) - 1)
+    return name
+  if item:
+    return FirstWord(item)
+  return None
+
+
+def FirstWord(item):
+  """Get an item's first (shell-style) word, which names it."""
+  return shlex.split(item)[0]
+
+
+def BuildCommand(command, item, mapdict):
+  """Build the command for an item, or batch of items via %@."""
+  if not isinstance(item, list):
+    return [Interpolate(x, item, mapdict) for x in command]
+  result = []
+  fixedmap = dict([(k, mapdict[k]) for k in (HOST_KEY, SLOT_KEY)
+                   if k in mapdict])
+  for word in command:
+    if BATCH_SUBST in word:
+      result.extend([Interpolate(word, x, mapdict) for x in item])
+    else:
+      result.append(Interpolate(word, '', fixedmap))
+  return result
+
+
+def StartProcess(item, command, mapdict, shell=False, zygote=None,
+                 host=None, slot=None, pin=None, in_fd=None, out_fd=None,
+                 err_fd=None):
+  """Start process for one item or batch; may raise OSError."""
+  # pylint: disable=too-many-arguments
+  mapdict = dict(mapdict)
+  if host:
+    mapdict[HOST_KEY] = lambda _: host
+  mapdict[SLOT_KEY] = lambda _: str(slot)
+  cmd = BuildCommand(command, item, mapdict)
+  proc = Process(ItemName(item), cmd, shell=shell, zygote=zygote, pin=pin,
+                 in_fd=in_fd, out_fd=out_fd, err_fd=err_fd)
+  proc.item = item
+  proc.host = host
+  proc.slot = slot
+  if isinstance(item, list):
+    proc.count = len(item)
+  return proc
+
+
+class HostPool(object):
+  """Machines with per-machine slot counts, for distributing items."""
+
+  def __init__(self, specs):
+    self.slots = collections.OrderedDict()
+    for spec in specs:
+      host, count = self.Parse(spec)
+      self.slots[host] = self.slots.get(host, 0) + count
+    self.busy = dict.fromkeys(self.slots, 0)
+
+  @staticmethod
+  def Parse(spec):
+    """Split <machine>[/<n>] into machine and slot count.
+
+    Raises:
+      HostSpecError: if the machine is empty or the count isn't positive
+    """
+    host, sep, count = spec.rpartition('/')
+    if not sep:
+      return spec, 1
+    try:
+      count = int(count)
+    except ValueError:
+      raise HostSpecError(spec)
+    if not host or count < 1:
+      raise HostSpecError(spec)
+    return host, count
+
+  def Capacity(self):
+    """Get the total number of slots."""
+    return sum(self.slots.values())
+
+  def HasRoom(self):
+    """Check whether any machine has a free slot."""
+    return sum(self.busy.values()) < self.Capacity()
+
+  def Acquire(self):
+    """Take a slot on the machine with the most free; return machine."""
+    best = None
+    most = 0
+    for host, count in self.slots.items():
+      free = count - self.busy[host]
+      if free > most:
+        best, most = host, free
+    if best is not None:
+      self.busy[best] += 1
+    return best
+
+  def Release(self, host):
+    """Free a slot on a machine."""
+    self.busy[host] -= 1
+
+
+class History(object):
+  """Persisted item durations, for longest-first ordering."""
+  # The file is JSON, mapping the command template to a map of item
+  # to duration of its last successful run.
+
+  def __init__(self, path, command, shell=False):
+    self.path = path
+    self.key = ShellStr(command) if shell else json.dumps(command)
+    self.data = {}
+    try:
+      with open(path) as histfile:
+        self.data = json.load(histfile)
+    except (IOError, OSError, ValueError) as exc:
+      if getattr(exc, 'errno', None) != errno.ENOENT:
+        print('%%Ignoring history file %s: %s' % (path, exc),
+              file=sys.stderr)
+    self.times = self.data.setdefault(self.key, {})
+
+  def Estimator(self, items):
+    """Get a duration function for items, guessing the average if unknown."""
+    known = [self.times[x] for x in items if x in self.times]
+    guess = sum(known) / len(known) if known else 0.0
+    return lambda x: self.times.get(x, guess)
+
+  def Order(self, items):
+    """Sort items longest first."""
+    # Stable, so unknown or equal items keep their original order
+    return sorted(items, key=self.Estimator(items), reverse=True)
+
+  def Record(self, job):
+    """Record a finished job's duration, if it's a successful single item."""
+    if not job.ret and not isinstance(job.item, list):
+      self.times[job.item] = round(job.finished - job.started, 3)
+
+  def Save(self):
+    """Write the history file, atomically replacing the old one."""
+    tmpname = '%s.%d.tmp' % (self.path, os.getpid())
+    try:
+      with open(tmpname, 'w') as histfile:
+        json.dump(self.data, histfile, sort_keys=True)
+      os.rename(tmpname, self.path)
+    except (IOError, OSError) as exc:
+      print('%%Unable to save history file %s: %s' % (self.path, exc),
+            file=sys.stderr)
+
+
+class Journal(object):
+  """Log of finished items, for resuming interrupted runs."""
+  # Each line is tab-separated: start time, elapsed time, exit code,
+  # signal, machine ('-' if local), and item.  The file is written as bytes
+  # in the filesystem encoding, like the items as read, with backslashes,
+  # tabs, and newlines in items escaped.
+  HEADER = b'Start\tElapsed\tExit\tSignal\tMachine\tItem\n'
+  FLUSH_INTERVAL = 1.0  # Seconds between flushes, to keep writes cheap
+  ESCAPES = [('\\', '\\\\'), ('\t', '\\t'), ('\n', '\\n')]
+  UNESCAPE_RE = re.compile(r'\\(.)')
+  UNESCAPES = {'t': '\t', 'n': '\n'}
+
+  def __init__(self, path, resume=False):
+    self.path = path
+    self.succeeded = set()
+    if resume:
+      self._Load()
+    self.logfile = open(path, 'ab')
+    if not self.logfile.tell():
+      self.logfile.write(self.HEADER)
+    self.flushed = time.time()
+
+  @classmethod
+  def _Escape(cls, item):
+    for char, escaped in cls.ESCAPES:
+      item = item.replace(char, escaped)
+    return item
+
+  @classmethod
+  def _Unescape(cls, item):
+    return cls.UNESCAPE_RE.sub(
+        lambda m: cls.UNESCAPES.get(m.group(1), m.group(1)), item)
+
+  def _Load(self):
+    try:
+      logfile = open(self.path, 'rb')
+    except (IOError, OSError) as exc:
+      if exc.errno != errno.ENOENT:
+        raise
+      return
+    with logfile:
+      for line in logfile:
+        fields = FSDecode(line.rstrip(b'\n')).split('\t', 5)
+        if len(fields) < 6 or fields[0] == 'Start':
+          continue
+        if fields[2] == '0' and fields[3] == '0':
+          self.succeeded.add(self._Unescape(fields[5]))
+
+  def Skip(self, item):
+    """Check whether an item already succeeded."""
+    return item in self.succeeded
+
+  def Record(self, job):
+    """Log a finished job's item(s)."""
+    exitcode, sig = (job.ret, 0) if job.ret >= 0 else (0, -job.ret)
+    prefix = '%.3f\t%.3f\t%d\t%d\t%s\t' % (
+        job.started, job.finished - job.started, exitcode, sig,
+        job.host or '-')
+    items = job.item if isinstance(job.item, list) else [job.item or '']
+    self.logfile.write(FSEncode(
+        ''.join([prefix + self._Escape(x) + '\n' for x in items])))
+    now = time.time()
+    if now - self.flushed >= self.FLUSH_INTERVAL:
+      self.logfile.flush()
+      self.flushed = now
+
+  def Close(self):
+    """Flush and close the log."""
+    self.logfile.close()
+
+
+class Results(object):
+  """Per-item directories that jobs write their output into directly."""
+  # Each item's directory holds "stdout" and "stderr" files, opened here and
+  # passed as the child's fds, so none of that output comes through us, plus
+  # an "item" file with the full item(s), since names may be ambiguous
+  OPEN_FLAGS = os.O_WRONLY | os.O_CREAT | getattr(os, 'O_CLOEXEC', 0)
+
+  def __init__(self, path, template, mapdict):
+    self.path = path
+    self.template = template  # Substitution naming each item's directory
+    self.mapdict = mapdict
+    self.dirs = {}  # Item sequence number -> directory, for retries, stages
+    self.used = set()
+    try:
+      os.makedirs(path)
+    except OSError as exc:
+      if exc.errno != errno.EEXIST:
+        raise
+
+  def _Name(self, item):
+    if isinstance(item, list):
+      name = self._Name(item[0])
+      return '%s+%d' % (name, len(item) - 1) if len(item) > 1 else name
+    name = Interpolate(self.template, item, self.mapdict).replace('/', '_')
+    return name if name.strip('.') else '_' + name
+
+  def _Dir(self, item, seq):
+    if seq in self.dirs:
+      return self.dirs[seq]
+    # Items with the same name get numbered directories
+    base = name = self._Name(item)
+    count = 1
+    while name in self.used:
+      count += 1
+      name = '%s.%d' % (base, count)
+    self.used.add(name)
+    path = os.path.join(self.path, name)
+    try:
+      os.mkdir(path)
+    except OSError as exc:
+      if exc.errno != errno.EEXIST:
+        raise
+    items = item if isinstance(item, list) else [item]
+    with open(os.path.join(path, 'item'), 'wb') as itemfile:
+      itemfile.write(FSEncode(''.join([x + '\n' for x in items])))
+    self.dirs[seq] = path
+    return path
+
+  def Open(self, item, seq, stage, last):
+    """Open an item's files for a stage; return (dir, stdout fd, stderr fd).
+
+    Each item (by its sequence number) gets a new directory, and each
+    attempt's first stage starts the files afresh; later --then stages add
+    to its stderr.  Only the last stage writes stdout (else its fd is None).
+    The caller closes the fds.
+    """
+    path = self._Dir(item, seq)
+    # Appending, since stages may write at once
+    err_fd = os.open(os.path.join(path, 'stderr'),
+                     self.OPEN_FLAGS | os.O_APPEND | (0 if stage
+                                                      else os.O_TRUNC),
+                     0o666)
+    out_fd = None
+    if last:
+      try:
+        out_fd = os.open(os.path.join(path, 'stdout'),
+                         self.OPEN_FLAGS | os.O_TRUNC, 0o666)
+      except OSError:
+        os.close(err_fd)
+        raise
+    return path, out_fd, err_fd
+
+  @staticmethod
+  def Sizes(path):
+    """Get the sizes of a directory's stdout and stderr, where present."""
+    sizes = []
+    for name in ('stdout', 'stderr'):
+      try:
+        sizes.append(os.path.getsize(os.path.join(path, name)))
+      except OSError:
+        sizes.append(None)
+    return sizes
+
+
+class Batcher(object):
+  """Packer of items into batches for %@, xargs-style."""
+  ARG_OVERHEAD = 1 + struct.calcsize('P')  # NUL plus argv pointer
+  ARG_MAX_SLOP = 4096
+  MAX_ARG_STRLEN = 131072  # Linux limit on any single argument
+
+  def __init__(self, command, mapdict, jobs, max_args=None, max_chars=None,
+               joined=False):
+    # pylint: disable=too-many-arguments
+    self.words = [x for x in command if BATCH_SUBST in x]
+    self.mapdict = mapdict
+    self.jobs = jobs
+    self.max_args = max_args
+    self.size = max_args
+    self.spread = None  # (items, slots) left to share them evenly among
+    # With -S (or remotely, via ssh), the words are joined into one
+    # argument, each costing just its separating space (or the final NUL)
+    self.overhead = 1 if joined else self.ARG_OVERHEAD
+    fixed = [x for x in command if BATCH_SUBST not in x]
+    self.base = sum([len(x) + self.overhead for x in fixed])
+    self.limit = self.ArgLimit()
+    if joined:
+      self.limit = min(self.limit, self.MAX_ARG_STRLEN)
+    if max_chars:
+      self.limit = min(self.limit, max_chars)
+
+  @classmethod
+  def ArgLimit(cls):
+    """Get the space available for arguments, less the environment."""
+    try:
+      arg_max = os.sysconf('SC_ARG_MAX')
+    except (ValueError, OSError):
+      arg_max = 131072  # POSIX minimum is 4096, but Linux used to be this
+    env = sum([len(k) + len(v) + 1 + cls.ARG_OVERHEAD
+               for k, v in os.environ.items()])
+    return arg_max - env - cls.ARG_MAX_SLOP
+
+  def _Cost(self, item):
+    return sum([len(Interpolate(x, item, self.mapdict)) + self.overhead
+                for x in self.words])
+
+  def Plan(self, pending):
+    """Set the batch size for the slots about to be filled."""
+    self.size = self.max_args or 0
+    self.spread = None
+    if self.jobs and pending.AtEnd():
+      # Spread the remainder evenly across the slots
+      self.spread = (pending.Available(), self.jobs)
+
+  def Next(self, pending):
+    """Take the next batch from the pending items."""
+    size = self.size
+    if self.spread:
+      # Rounding up for each slot in turn gives sizes differing by <= 1
+      items, slots = self.spread
+      share = -(-items // slots)
+      size = min(size, share) if size else share
+    batch = [pending.Next()]
+    used = self.base + self._Cost(batch[0])
+    while (not size or len(batch) < size) and pending:
+      cost = self._Cost(pending.Peek())
+      if used + cost > self.limit:
+        break
+      batch.append(pending.Next())
+      used += cost
+    if self.spread:
+      self.spread = (items - len(batch), max(slots - 1, 1))
+    return batch
+
+
+class Pipeline(object):  # pylint: disable=too-few-public-methods
+  """An item's processes for the --then stages, connected by pipes."""
+  # The output of each stage goes into a pipe which we never read, and
+  # whose read end we hold only until the next stage can be started with it
+  # as its stdin.  Until then, a full pipe simply blocks the earlier stage.
+
+  def __init__(self, proc):
+    self.procs = [proc]
+    self.rets = []  # In stage order, with 127 for stages not started
+    self.pipe = None  # Read end awaiting the next stage
+    self.live = 1  # Stages still running
+    self.stopped = False  # Later stages not started, due to a shutdown
+
+  def Ret(self):
+    """Get the pipeline's exit code: the last failure, as with pipefail."""
+    # An earlier stage getting SIGPIPE just means a later one stopped reading
+    last = len(self.rets) - 1
+    failed = [x for i, x in enumerate(self.rets)
+              if x and not (x == -signal.SIGPIPE and i < last)]
+    return failed[-1] if failed else 0
+
+
+class Timers(object):
+  """Heap of timed callbacks."""
+
+  def __init__(self):
+    self.heap = []  # [due time, seq, func, args], with func None if canceled
+    self.seq = 0
+
+  def Add(self, delay, func, *args):
+    """Call func(*args) after delay seconds; return an entry for Cancel."""
+    self.seq += 1
+    entry = [time.time() + delay, self.seq, func, args]
+    heapq.heappush(self.heap, entry)
+    return entry
+
+  @staticmethod
+  def Cancel(entry):
+    """Cancel a timer, if not already run."""
+    if entry:
+      entry[2] = entry[3] = None
+
+  def Timeout(self, limit):
+    """Get the poll timeout in ms until the next timer, at most limit."""
+    while self.heap and not self.heap[0][2]:
+      heapq.heappop(self.heap)
+    if not self.heap:
+      return limit
+    due = (self.heap[0][0] - time.time()) * 1000
+    return max(0, min(limit, int(math.ceil(due))))
+
+  def Run(self):
+    """Run all timers that are due."""
+    now = time.time()
+    while self.heap and self.heap[0][0] <= now:
+      _, _, func, args = heapq.heappop(self.heap)
+      if func:
+        func(*args)
+
+
+class KeptOrder(object):
+  """Output of jobs in the order their items started, for -k."""
+  # Only the head item's output is shown as it arrives; the rest is held
+  # (and may spill to disk) until every earlier item has finished
+
+  def __init__(self, names=False, tstamp=False):
+    self.names = names
+    self.tstamp = tstamp
+    self.head = 0  # Sequence number whose output is shown
+    self.live = collections.defaultdict(list)  # seq -> running jobs
+    self.held = collections.defaultdict(list)  # seq -> finished jobs
+    self.ended = set()  # Items finished, but not yet at the head
+    self.retrying = set()  # Items awaiting another attempt
+
+  def _Print(self, job):
+    job.Print(self.names, self.tstamp)
+    job.PrintLast(self.names, self.tstamp)
+    job.Close()
+
+  def Start(self, job, seq):
+    """Note a started job, with its item's sequence number."""
+    self.retrying.discard(seq)
+    job.seq = seq
+    self.live[seq].append(job)
+
+  def IsHead(self, job):
+    """Check whether a job's output should be shown as it arrives."""
+    return job.seq == self.head
+
+  def Release(self, job):
+    """Show an exited job's output, or hold it until its turn."""
+    live = self.live[job.seq]
+    if job in live:
+      live.remove(job)
+    if not live:
+      del self.live[job.seq]
+    if job.seq <= self.head:
+      self._Print(job)
+    else:
+      job.ClosePipes()
+      self.held[job.seq].append(job)
+
+  def Finish(self, job, retry=False):
+    """Release an item's job, and move on if it was the final attempt."""
+    self.Release(job)
+    if retry:
+      self.retrying.add(job.seq)
+    else:
+      self.ended.add(job.seq)
+      self._Advance()
+
+  def Drop(self):
+    """Stop waiting for retries that won't happen."""
+    self.ended |= self.retrying
+    self.retrying.clear()
+    self._Advance()
+
+  def _Advance(self):
+    while self.head in self.ended:
+      self.ended.remove(self.head)
+      self.head += 1
+      for job in self.held.pop(self.head, []):
+        self._Print(job)
+    # Catch up on the new head's output, which is then shown as it arrives
+    for job in self.live.get(self.head, []):
+      job.Print(self.names, self.tstamp)
+
+  def Flush(self):
+    """Show whatever is still held, in order."""
+    for seq in sorted(self.held):
+      for job in self.held.pop(seq):
+        self._Print(job)
+
+
+class Runner(object):  # pylint: disable=too-many-instance-attributes
+  """Main loop for running and monitoring processes."""
+  IDLE_POLL = 5000  # ms
+  GIVE_UP = 3  # Seconds after the last ladder step when shutting down
+  TIMED_OUT = 124  # Exit code counted for items stopped by --timeout
+
+  def __init__(self, parsed, poller, command, mapdict, pending, jobs,
+               zygote=None, batcher=None, history=None, pool=None,
+               journal=None, placement=None, cgroups=None, results=None):
+    # pylint: disable=too-many-arguments
+    self.parsed = parsed
+    self.poller = poller
+    self.command = command
+    self.mapdict = mapdict
+    self.pending = pending
+    self.jobs = jobs
+    self.procs = {}  # Active processes, in start order
+    self.fdmap = {}  # fd -> (process, iserr)
+    self.zygote = zygote
+    self.batcher = batcher
+    self.history = history
+    self.pool = pool
+    self.journal = journal
+    self.placement = placement
+    self.cgroups = cgroups
+    self.results = results
+    self.free_slots = []  # Heap of slot numbers freed by finished jobs
+    self.numslots = 0
+    self.workers = parsed.workers
+    self.idle = collections.deque()  # Idle workers
+    self.writers = {}  # Input fd -> worker, for those with input unsent
+    # Commands and concurrency limits for the first and any --then stages
+    self.stages = [command] + [shlex.split(x) for x in parsed.then or []]
+    self.limits = [jobs] + list(parsed.then_jobs or [])
+    self.limits += [jobs] * (len(self.stages) - len(self.limits))
+    self.running = [0] * len(self.stages)
+    # Per stage, pipelines waiting to start it
+    self.handoff = [collections.deque() for _ in self.stages]
+    self.waiting = 0
+    self.timers = Timers()
+    self.due = collections.deque()  # (item, attempt, seq) for retries due
+    self.retrying = 0  # Retries scheduled or due
+    self.watcher = ChildWatcher(poller, zygote)
+    self.done = []  # Only what the final report needs
+    self.dropped = []  # Items not run, due to failed dependencies
+    self.unfinished = []  # Items whose later stages a shutdown prevented
+    self.numdone = 0
+    self.numfailed = 0  # Failed items, for --halt
+    self.numworkers = 0
+    self.numitems = 0  # Items (or batches) started, for sequence numbers
+    self.itemsdone = 0
+    self.retval = 0
+    self.stopping = False  # No more launches or retries
+    self.shutdown = False  # After a terminating signal
+    self.gave_up = False
+    self.sigs_sent = set()
+    self.in_fd = None
+    self.order = None  # With -k, a KeptOrder
+    if parsed.keep_order:
+      self.order = KeptOrder(parsed.names, parsed.times)
+
+  def HasRoom(self):
+    """Check whether another process may be started."""
+    if self.workers and self.idle:
+      return True
+    if self.pool and not self.pool.HasRoom():
+      return False
+    # Slots are held by whole pipelines, so -j bounds the items in any stage
+    # (and the pipes awaiting later ones), not just the first
+    return not self.jobs or self.numslots - len(self.free_slots) < self.jobs
+
+  def _AcquireSlot(self):
+    """Get the lowest free slot number, and the job's placement if any."""
+    if self.free_slots:
+      slot = heapq.heappop(self.free_slots)
+    else:
+      self.numslots += 1
+      slot = self.numslots
+    return slot, self._Place(slot)
+
+  def _Place(self, slot):
+    """Get a new process's placement in a slot, or None."""
+    if not self.placement and not self.cgroups:
+      return None
+    cpus, node = self.placement.ForSlot(slot) if self.placement else (None,
+                                                                      None)
+    cgroup = self.cgroups.Create() if self.cgroups else None
+    return cpus, node, cgroup
+
+  def _ReleaseSlot(self, slot, pin):
+    heapq.heappush(self.free_slots, slot)
+    if pin and pin[2]:
+      self.cgroups.Remove(pin[2])
+
+  def _NextItem(self, batch=False):
+    """Return the next (item, attempt, seq), due retries first, or None."""
+    if self.due:
+      self.retrying -= 1
+      return self.due.popleft()
+    if not self.pending:
+      return None
+    item = self.batcher.Next(self.pending) if batch else self.pending.Next()
+    self.numitems += 1
+    return item, 1, self.numitems - 1
+
+  def _Retry(self, job):
+    """Requeue a failed job's item after a backoff delay."""
+    delay = self.parsed.retry_delay * 2 ** (job.attempt - 1)
+    print('[Returned %d for %s, attempt %d; retrying in %s]'
+          % (job.ret, job.name, job.attempt, ElapsedStr(delay)),
+          file=sys.stderr)
+    self.retrying += 1
+    self.timers.Add(delay, self._RetryDue,
+                    (job.item, job.attempt + 1, job.seq))
+
+  def _RetryDue(self, entry):
+    if not self.stopping:
+      self.due.append(entry)
+
+  def _Stop(self):
+    """Don't start anything new."""
+    self.stopping = True
+    self.pending.Clear()
+    self.due.clear()
+    self.retrying = 0
+    if self.order:
+      self.order.Drop()
+
+  def _StartTimeout(self, proc, job):
+    """Start the timeout for a job, which proc is running."""
+    if self.parsed.timeout:
+      job.timer = self.timers.Add(self.parsed.timeout, self._TimedOut,
+                                  proc, job)
+
+  def _StillOn(self, proc, job):
+    """Check whether proc is still running, and still on job if given."""
+    if proc not in self.procs:
+      return False
+    # A worker may have finished the item and moved on to another
+    return job is None or job is proc or proc.current is job
+
+  def _TimedOut(self, proc, job):
+    if not self._StillOn(proc, job):
+      return
+    job.timed_out = True
+    print('[%s timed out after %s]'
+          % (job.name, ElapsedStr(self.parsed.timeout)), file=sys.stderr)
+    for delay, sig in self.parsed.ladder:
+      self.timers.Add(delay, self._Escalate, [proc], sig, False, job)
+
+  def _Escalate(self, procs, sig, shutdown=False, job=None):
+    """Send a ladder step to whichever processes are still running job."""
+    procs = [x for x in procs if self._StillOn(x, job)]
+    if shutdown and procs:
+      print('%%Sending %s to remaining subprocesses' % SIG_NAMES.get(sig, sig),
+            file=sys.stderr)
+    for proc in procs:
+      proc.Signal(sig)
+
+  def _GiveUp(self):
+    if self.procs:
+      print('%Timed out killing subprocesses', file=sys.stderr)
+      self.retval = 999
+      self.gave_up = True
+
+  def _ReportStart(self, job):
+    if self.parsed.times:
+      if job.realname:
+        msg = '[%s started at %%s]' % job.realname
+      else:
+        msg = '[Started at %s]'
+      print(msg % TimeStr(job.started), file=sys.stderr)
+
+  def _Add(self, proc):
+    proc.Register(self.poller)
+    for fd, iserr in proc.Fds():
+      self.fdmap[fd] = (proc, iserr)
+    self.watcher.Add(proc)
+    self.procs[proc] = True
+    self.running[proc.stage] += 1
+
+  def _Ready(self):
+    """Get the number of items that could be started now."""
+    return len(self.due) + (self.pending.Available() if self.pending else 0)
+
+  def _Feed(self, proc):
+    """Write what we can of a worker's input, polling to write the rest."""
+    fd = proc.InFd()
+    if not proc.Flush():
+      if fd not in self.writers:
+        self.writers[fd] = proc
+        self.poller.register(fd, self.poller.POLLOUT)
+      return
+    if self.writers.pop(fd, None):
+      self.poller.unregister(fd)
+    if proc.ending:
+      proc.EndInput()
+
+  def _LaunchWorkers(self):
+    """Start workers up to the limit, and feed idle ones."""
+    parsed = self.parsed
+    # No more workers than items to give them
+    while len(self.procs) < self.jobs and len(self.idle) < self._Ready():
+      name = 'worker%d' % (self.numworkers + 1)
+      slot, pin = self._AcquireSlot()
+      cmd = BuildCommand(self.command, '', {SLOT_KEY: lambda _: str(slot)})
+      try:
+        proc = Worker(name, cmd, shell=parsed.shell, zygote=self.zygote,
+                      end=parsed.worker_end, null=parsed.null, pin=pin)
+      except OSError as exc:
+        print(repr(exc), file=sys.stderr)
+        self._ReleaseSlot(slot, pin)
+        return False
+      proc.slot = slot
+      proc.cgroup = pin and pin[2]
+      self.numworkers += 1
+      self._Add(proc)
+      self.idle.append(proc)
+    while self.idle:
+      proc = self.idle[0]
+      if proc not in self.procs:
+        self.idle.popleft()
+        continue
+      next_item = self._NextItem()
+      if not next_item:
+        break
+      self.idle.popleft()
+      job = proc.Send(next_item[0])
+      self._Feed(proc)
+      job.attempt = next_item[1]
+      job.seq = next_item[2]
+      if self.order:
+        self.order.Start(job, next_item[2])
+      self._StartTimeout(proc, job)
+      self._ReportStart(job)
+    if self.pending.exhausted and not self.retrying:
+      while self.idle:
+        self.idle.popleft().EndInput()
+    return True
+
+  def _NewPipe(self, stage):
+    """Get (read end, write end) for a stage's output, or Nones if last."""
+    if stage == len(self.stages) - 1:
+      return None, None
+    return CloexecPipe()
+
+  def _LaunchStages(self):
+    """Start later stages of pipelines, up to their limits."""
+    parsed = self.parsed
+    for stage in range(1, len(self.stages)):
+      handoff = self.handoff[stage]
+      limit = self.limits[stage]
+      while handoff and (not limit or self.running[stage] < limit):
+        pipeline = handoff.popleft()
+        self.waiting -= 1
+        first = pipeline.procs[0]
+        in_fd, pipeline.pipe = pipeline.pipe, None
+        pipe_r, pipe_w = self._NewPipe(stage)
+        proc = pin = None
+        path = out_fd = err_fd = None
+        try:
+          # The first stage's slot and host are held for the whole pipeline
+          pin = self._Place(first.slot)
+          if self.results:
+            path, out_fd, err_fd = self.results.Open(
+                first.item, first.seq, stage, pipe_w is None)
+          proc = StartProcess(first.item, self.stages[stage], self.mapdict,
+                              shell=parsed.shell, zygote=self.zygote,
+                              host=first.host, slot=first.slot, pin=pin,
+                              in_fd=in_fd,
+                              out_fd=pipe_w if out_fd is None else out_fd,
+                              err_fd=err_fd)
+        except OSError as exc:
+          print(repr(exc), file=sys.stderr)
+          if pin and pin[2]:
+            self.cgroups.Remove(pin[2])
+          if pipe_r is not None:
+            os.close(pipe_r)
+        finally:
+          for fd in (in_fd, pipe_w, out_fd, err_fd):
+            if fd is not None:
+              os.close(fd)
+        if not proc:
+          self._Abandon(pipeline)
+          continue
+        proc.pipeline = pipeline
+        proc.stage = stage
+        proc.seq = first.seq
+        proc.results = path
+        proc.cgroup = pin and pin[2]
+        if self.order:
+          self.order.Start(proc, first.seq)
+        pipeline.procs.append(proc)
+        pipeline.live += 1
+        pipeline.pipe = pipe_r
+        self._StartTimeout(proc, proc)
+        self._Add(proc)
+        if pipe_r is not None:
+          self.handoff[stage + 1].append(pipeline)
+          self.waiting += 1
+
+  def _Abandon(self, pipeline, stopped=False):
+    """Give up on starting the rest of a pipeline, failed or stopped."""
+    if pipeline.pipe is not None:
+      os.close(pipeline.pipe)
+      pipeline.pipe = None
+    if stopped:
+      pipeline.stopped = True
+    else:
+      pipeline.rets.extend([127] * (len(self.stages) - len(pipeline.procs)))
+    if not pipeline.live:
+      self._EndPipeline(pipeline)
+
+  def Launch(self):
+    """Start pending processes up to the limit; return False on error."""
+    parsed = self.parsed
+    if self.workers:
+      return self._LaunchWorkers()
+    self._LaunchStages()
+    if self.batcher and self.HasRoom() and self.pending:
+      self.batcher.Plan(self.pending)
+    while self.HasRoom():
+      next_item = self._NextItem(batch=bool(self.batcher))
+      if not next_item:
+        break
+      item, attempt, seq = next_item
+      host = self.pool.Acquire() if self.pool else None
+      slot, pin = self._AcquireSlot()
+      pipe_r, pipe_w = self._NewPipe(0)
+      path = out_fd = err_fd = None
+      try:
+        if self.results:
+          path, out_fd, err_fd = self.results.Open(item, seq, 0,
+                                                   pipe_w is None)
+        proc = StartProcess(item, self.command, self.mapdict,
+                            shell=parsed.shell, zygote=self.zygote,
+                            host=host, slot=slot, pin=pin,
+                            out_fd=pipe_w if out_fd is None else out_fd,
+                            err_fd=err_fd)
+      except OSError as exc:
+        print(repr(exc), file=sys.stderr)
+        if host:
+          self.pool.Release(host)
+        self._ReleaseSlot(slot, pin)
+        if pipe_r is not None:
+          os.close(pipe_r)
+        return False
+      finally:
+        for fd in (pipe_w, out_fd, err_fd):
+          if fd is not None:
+            os.close(fd)
+      if pipe_r is not None:
+        proc.pipeline = Pipeline(proc)
+        proc.pipeline.pipe = pipe_r
+        self.handoff[1].append(proc.pipeline)
+        self.waiting += 1
+      proc.attempt = attempt
+      proc.seq = seq
+      proc.results = path
+      if self.order:
+        self.order.Start(proc, seq)
+      proc.cgroup = pin and pin[2]
+      self._StartTimeout(proc, proc)
+      self._ReportStart(proc)
+      self._Add(proc)
+    return True
+
+  def _Refill(self):
+    if not self.Launch():
+      self.retval = max(self.retval, 127)
+      self._Stop()
+
+  def _ForwardSignals(self):
+    poller = self.poller
+    parsed = self.parsed
+    sigs_to_send = poller.sigs_rcvd - self.sigs_sent
+    for sig in sigs_to_send:
+      if parsed.verbose:
+        print('[Forwarding signal %d (%s) to subprocesses]'
+              % (sig, SIG_MAP.get(sig, '?')),
+              file=sys.stderr)
+        sys.stderr.flush()
+      for proc in self.procs:
+        proc.Signal(sig)
+    self.sigs_sent |= sigs_to_send
+    if not self.shutdown:
+      if parsed.signal_test or self.sigs_sent - SIG_WAIT:
+        self.shutdown = True
+        # The forwarded signal stands in for the ladder's first step
+        self._Shutdown(parsed.ladder[1:])
+
+  def _Shutdown(self, steps):
+    """Start nothing new, and stop the running processes via ladder steps."""
+    self.shutdown = True
+    self._Stop()
+    for handoff in self.handoff:
+      while handoff:
+        self.waiting -= 1
+        self._Abandon(handoff.popleft(), stopped=True)
+    procs = list(self.procs)
+    for delay, sig in steps:
+      self.timers.Add(delay, self._Escalate, procs, sig, True)
+    self.timers.Add(self.parsed.ladder[-1][0] + self.GIVE_UP, self._GiveUp)
+
+  def _CheckHalt(self):
+    """Apply the --halt policy, if there are enough failures."""
+    now, count, percent = self.parsed.halt
+    if self.shutdown or (self.stopping and not now):
+      return
+    if percent:
+      # Until all input is read, the total so far would be too low
+      if not self.pending.TotalKnown():
+        return
+      count = count * self.pending.Total() / 100.0
+    if self.numfailed < count:
+      return
+    print('[Halting after %d failed items: %s]'
+          % (self.numfailed, 'stopping running items' if now
+             else 'starting no more'), file=sys.stderr)
+    if now:
+      # Even with nothing running, pipelines may be waiting for later stages
+      self._Shutdown(self.parsed.ladder)
+    else:
+      self._Stop()
+
+  def _UpdateInput(self):
+    # Wake up for more input only when there's room to use it
+    want_fd = self.pending.Waiting() if self.HasRoom() else None
+    if want_fd != self.in_fd:
+      if self.in_fd is not None:
+        self.poller.unregister(self.in_fd)
+      if want_fd is not None:
+        self.poller.register(want_fd, self.poller.POLLIN)
+      self.in_fd = want_fd
+
+  def _Output(self, proc):
+    parsed = self.parsed
+    if self.order:
+      if isinstance(proc, Worker):
+        Job.Print(proc, parsed.names, parsed.times)  # Not an item's
+        proc = proc.current
+      # Only the head item's output is shown in real time
+      if proc and self.order.IsHead(proc):
+        proc.Print(parsed.names, parsed.times)
+      return
+    # When down to last process, output in real time
+    if not parsed.sequential or len(self.procs) < 2:
+      proc.Print(parsed.names, parsed.times)
+
+  def _Finish(self, proc, ret):
+    """Handle a process that has exited."""
+    del self.procs[proc]
+    self.running[proc.stage] -= 1
+    self.watcher.Remove(proc)
+    for fd in proc.fds:
+      self.fdmap.pop(fd, None)
+    if isinstance(proc, Worker) and proc.proc.stdin:
+      if self.writers.pop(proc.InFd(), None):
+        self.poller.unregister(proc.InFd())
+    proc.Unregister()
+    proc.ret = ret
+    if proc.cgroup:
+      proc.usage = self.cgroups.Usage(proc.cgroup)
+    if proc.pipeline:
+      # The slot and host are released when the whole pipeline ends
+      self.timers.Cancel(proc.timer)
+      if proc.cgroup:
+        self.cgroups.Remove(proc.cgroup)
+      self._EndStage(proc)
+      return
+    self._ReleaseSlot(proc.slot, (None, None, proc.cgroup))
+    if isinstance(proc, Worker):
+      self._EndWorker(proc, ret)
+      return
+    if proc.host:
+      self.pool.Release(proc.host)
+    self._Complete(proc)
+
+  def _EndStage(self, proc):
+    """Handle the exit of one stage of a pipeline."""
+    parsed = self.parsed
+    pipeline = proc.pipeline
+    pipeline.live -= 1
+    if proc is not pipeline.procs[-1] or pipeline.pipe is not None:
+      # Only the last stage's output is the item's
+      if self.order:
+        self.order.Release(proc)
+      else:
+        proc.Print(parsed.names, parsed.times)
+        proc.PrintLast(parsed.names, parsed.times)
+        proc.Close()
+    if not pipeline.live and pipeline.pipe is None:
+      self._EndPipeline(pipeline)
+    else:
+      self._Refill()
+
+  def _EndPipeline(self, pipeline):
+    """Complete an item whose pipeline stages have all exited."""
+    rets = [x.ret for x in pipeline.procs]
+    pipeline.rets = rets + pipeline.rets
+    # The last stage stands in for the item, as if it ran the whole time
+    first = pipeline.procs[0]
+    self._ReleaseSlot(first.slot, None)
+    if first.host:
+      self.pool.Release(first.host)
+    job = pipeline.procs[-1]
+    for attr in ('started', 'attempt'):
+      setattr(job, attr, getattr(first, attr))
+    job.timer = None
+    job.timed_out = any([x.timed_out for x in pipeline.procs])
+    job.usage = Cgroups.Total([x.usage for x in pipeline.procs])
+    job.ret = pipeline.Ret()
+    if pipeline.stopped and not job.ret:
+      self._Unfinished(job)
+      return
+    self._Complete(job)
+
+  def _Unfinished(self, job):
+    """Handle an item whose pipeline was cut short without failing."""
+    # Neither a success nor a failure, much like --deps' dropped items
+    parsed = self.parsed
+    if self.order:
+      self.order.Finish(job)
+    else:
+      job.Print(parsed.names, parsed.times)
+      job.PrintLast(parsed.names, parsed.times)
+      job.Close()
+    self.unfinished.append(job.name)
+
+  def _EndWorker(self, proc, ret):
+    """Handle a worker that has exited."""
+    parsed = self.parsed
+    proc.ret = ret
+    proc.FailCurrent(ret)
+    for job in proc.TakeCompleted():
+      self._Complete(job)
+    proc.Print(parsed.names, parsed.times)
+    proc.PrintLast(parsed.names, parsed.times)
+    proc.Close()
+    if ret or parsed.verbose:
+      print('[Worker %s returned %d]' % (proc.name, ret), file=sys.stderr)
+      if ret > self.retval:
+        self.retval = ret
+    # Replace it if there's more to do
+    self._Refill()
+
+  def _Complete(self, job):
+    """Handle a finished job."""
+    parsed = self.parsed
+    ret = job.ret
+    retry = ret and job.attempt <= parsed.retries and not self.stopping
+    if self.order:
+      self.order.Finish(job, retry)
+    else:
+      job.Print(parsed.names, parsed.times)
+      job.PrintLast(parsed.names, parsed.times)
+      job.Close()
+    self.timers.Cancel(job.timer)
+    if retry:
+      # Only the final attempt counts
+      self._Retry(job)
+      self._Refill()
+      return
+    self.numdone += 1
+    self.itemsdone += job.count
+    if ret:
+      self.numfailed += job.count
+    if self.history:
+      self.history.Record(job)
+    if self.journal:
+      self.journal.Record(job)
+    for item, cause in self.pending.Done(job):
+      self.dropped.append(ItemName(item))
+      print('[Skipping %s, which depends on failed %s]'
+            % (self.dropped[-1], cause), file=sys.stderr)
+    # Only keep what the final report needs, to bound memory on long runs
+    if ret or parsed.verbose:
+      self.done.append(job)
+    if ret or parsed.verbose or parsed.times:
+      if job.realname:
+        nstr = ' for ' + job.realname
+      else:
+        nstr = ''
+      if job.host:
+        nstr += ' on ' + job.host
+      if job.attempt > 1:
+        nstr += ', attempt %d' % job.attempt
+      if job.timed_out:
+        nstr += ', timed out'
+      if job.usage and (parsed.verbose or parsed.times):
+        peak, cpu = job.usage
+        if peak is not None:
+          nstr += ', peak memory %s' % SizeStr(peak)
+        nstr += ', CPU %s' % ElapsedStr(cpu)
+      if job.results and parsed.verbose:
+        nstr += ', wrote %s' % ' + '.join(
+            ['%s %s' % (SizeStr(x), y) for x, y
+             in zip(Results.Sizes(job.results), ('stdout', 'stderr'))
+             if x is not None])
+      if parsed.times:
+        tstr = (' at %s, took %s'
+                % (TimeStr(job.finished),
+                   ElapsedStr(job.finished - job.started)))
+      else:
+        tstr = ''
+      print('[Returned %d%s%s]' % (ret, nstr, tstr),
+            file=sys.stderr)
+      # As with timeout(1), since the signal alone wouldn't count
+      code = self.TIMED_OUT if job.timed_out else ret
+      if code > self.retval:
+        self.retval = code
+    if ret and parsed.halt:
+      self._CheckHalt()
+    # Refill the freed slot from the pending items
+    self._Refill()
+    running = list(self.procs)
+    if self.workers:
+      running = [x.current for x in running if x.current]
+    if parsed.verbose and running:
+      if self.numdone > 1:
+        results = [p.ResultStr() for p in self.done]
+        print('[Returns (%d/%s): %s; retval = %d]'
+              % (self.itemsdone, self.pending.TotalStr(), ', '.join(results),
+                 self.retval),
+              file=sys.stderr)
+      names = [x.name for x in running]
+      print('[Still running (%d/%s): %s]'
+            % (sum([x.count for x in running]), self.pending.TotalStr(),
+               ','.join(names)),
+            file=sys.stderr)
+    # If transitioning to last process while sequential, catch up
+    if parsed.sequential and not self.order and len(self.procs) == 1:
+      next(iter(self.procs)).Print(parsed.names, parsed.times)
+
+  def _WorkerOutput(self, proc):
+    completed = proc.TakeCompleted()
+    for job in completed:
+      self._Complete(job)
+    if completed and proc.Idle() and proc in self.procs:
+      self.idle.append(proc)
+      self._Refill()
+
+  def Run(self):
+    """Run everything to completion; return the aggregate exit code."""
+    if not self.Launch():
+      return 127
+    if self.parsed.verbose and not self.parsed.times:
+      print('[Started: %s]' % ','.join([x.name for x in self.procs]))
+    while (self.procs or self.retrying or self.waiting
+           or self.pending.Waiting() is not None):
+      if self.poller.sigs_rcvd:
+        self._ForwardSignals()
+      self.timers.Run()
+      if self.gave_up:
+        break
+      # Pick up any newly arrived input items, and due retries
+      self._Refill()
+      self._UpdateInput()
+      exited = []
+      for xfd, _ in self.poller.poll(self.timers.Timeout(self.IDLE_POLL)):
+        if xfd in self.writers:
+          self._Feed(self.writers[xfd])
+          continue
+        entry = self.fdmap.get(xfd)
+        if not entry:
+          proc = self.watcher.Exited(xfd)
+          if proc:
+            exited.append(proc)
+          continue  # Else input fd, handled by _Refill()
+        proc, iserr = entry
+        if proc.Read(iserr):
+          self._Output(proc)
+          if self.workers:
+            self._WorkerOutput(proc)
+        elif not proc.open[iserr]:
+          del self.fdmap[xfd]
+      exited.extend(self.watcher.Signaled(self.procs))
+      # Output events come first, so exits see all output up to now
+      for proc in exited:
+        if proc not in self.procs:
+          continue
+        ret = proc.Poll()
+        if ret is not None:
+          self._Output(proc)
+          self._Finish(proc, ret)
+      self.watcher.ReapStrays()
+    self.watcher.ReapStrays(force=True)
+    if self.order:
+      self.order.Flush()
+    return self.retval
+
+
 def main(argv):
-  # pylint: disable=too-many-locals,too-many-branches,too-many-statements
+  # pylint: disable=too-many-branches,too-many-statements
   """Main function."""
   prog = os.path.basename(argv[0])
   _, parsed, args = ParseArgs(prog, argv[1:])
   pdb_module = sys.modules.get('pdb')
   if pdb_module:
     pdb_module.set_trace()
+  CloexecInherited()
   if parsed.command:
     command = shlex.split(parsed.command)
   else:
@@ -513,23 +3454,42 @@ def main(argv):
   if not command:
     print('%s: must specify command' % prog, file=sys.stderr)
     return 2
+  zygote = None
+  if parsed.zygote:
+    # Fork the helper before we grow
+    if Zygote.AVAILABLE:
+      zygote = Zygote()
+    else:
+      print('%Launcher helper unavailable, launching directly',
+            file=sys.stderr)
   poller = Poller()
   if poller.POLL_FIX:
     print('%Substituting for missing select.poll', file=sys.stderr)
   if parsed.signal_test:
     print('[This pid = %d]' % os.getpid())
-  procs = []
-  done = []
-  retval = 0
   mapdict = PATH_MAP
+  pool = None
+  have_items = bool(parsed.args or parsed.arg_file)
   if parsed.arg_file:
-    args = [l.rstrip() for l in parsed.arg_file.readlines()]
+    args = ItemSource(reader=ArgReader(parsed.arg_file))
+    args.Fill(block=True)
     mapdict = ARG_MAP
   if parsed.args:
     args = SplitArgs(parsed.args)
   if parsed.machines:
-    args = SplitArgs(parsed.machines)
-    mapdict = MACH_MAP
+    try:
+      if have_items:
+        # Distribute the items across the machines
+        pool = HostPool(SplitArgs(parsed.machines))
+        mapdict = dict(mapdict)
+        mapdict[HOST_KEY] = str  # Replaced per process
+      else:
+        args = [HostPool.Parse(x)[0] for x in SplitArgs(parsed.machines)]
+        mapdict = MACH_MAP
+    except HostSpecError as exc:
+      print('%s: bad machine (want <machine>[/<n>], n > 0): %s'
+            % (prog, exc), file=sys.stderr)
+      return 2
     sshopts = '-4T' if parsed.ipv4 else '-6T' if parsed.ipv6 else '-T'
     command = ['ssh', sshopts, '%M'] + command
   if not args:
@@ -538,127 +3498,184 @@ def main(argv):
       return 2
     args = ['']
     mapdict = NULL_MAP
+  jobs = parsed.jobs
+  if jobs is None:
+    jobs = DefaultJobs(parsed, pool)
+  if jobs < 0:
+    print('%s: -j must not be negative' % prog, file=sys.stderr)
+    return 2
+  batcher = None
+  if [x for x in command if BATCH_SUBST in x]:
+    if not have_items:
+      print('%s: %s requires -a or -f items' % (prog, BATCH_SUBST),
+            file=sys.stderr)
+      return 2
+    mapdict = dict(mapdict)
+    mapdict[BATCH_SUBST[1]] = str
+    mapdict[SLOT_KEY] = str  # Only for estimating sizes
+    batcher = Batcher(command, mapdict, jobs, parsed.max_args,
+                      parsed.max_chars,
+                      joined=bool(parsed.shell or parsed.machines))
+  elif parsed.max_args or parsed.max_chars:
+    print('%s: --max-args and --max-chars require %s'
+          % (prog, BATCH_SUBST), file=sys.stderr)
+    return 2
+  if parsed.workers is not None:
+    if parsed.workers < 1 or parsed.jobs is not None:
+      print('%s: --workers needs a positive count, and excludes -j' % prog,
+            file=sys.stderr)
+      return 2
+    if batcher or pool or not have_items:
+      print('%s: --workers requires -a or -f items, without %s or -m'
+            % (prog, BATCH_SUBST), file=sys.stderr)
+      return 2
+    # Items go to the workers' stdin, not the command
+    jobs = parsed.workers
+    mapdict = NULL_MAP
+  if parsed.then and parsed.workers is not None:
+    print('%s: --then excludes --workers' % prog, file=sys.stderr)
+    return 2
+  if len(parsed.then_jobs or []) > len(parsed.then or []):
+    print('%s: more --then-jobs than --then stages' % prog, file=sys.stderr)
+    return 2
+  if [x for x in parsed.then_jobs or [] if x < 0]:
+    print('%s: --then-jobs must not be negative' % prog, file=sys.stderr)
+    return 2
+  template = None
+  if parsed.results:
+    # Name each item's results the same way as its data
+    for key in ('N', '0', HOST_KEY):
+      if key in mapdict:
+        template = '%' + key
+        break
+    if not template:
+      print('%s: --results requires -a, -f, or -m items, without --workers'
+            % prog, file=sys.stderr)
+      return 2
+  try:
+    for stage in [command] + [shlex.split(x) for x in parsed.then or []]:
+      BuildCommand(stage, [''] if batcher else '',
+                   dict(mapdict, **{SLOT_KEY: str}))
+  except UnknownInterpolation as exc:
+    print('%s: unknown substitution %s' % (prog, exc), file=sys.stderr)
+    return 2
+  if not (parsed.names or parsed.times or parsed.sequential
+          or parsed.keep_order):
+    # Only whole lines need to be kept together, and with just one job at
+    # a time, not even that
+    single = jobs == 1 and not parsed.then
+    Process.PASSTHROUGH = ('splice' if single and hasattr(os, 'splice')
+                           else 'copy')
+  if parsed.sequential or parsed.keep_order:
+    Job.SPILL_AT = parsed.spill
+  placement = None
+  if parsed.pin:
+    if not Placement.AVAILABLE or pool:
+      print('%s: --pin needs CPU affinity support, and excludes -m items'
+            % prog, file=sys.stderr)
+      return 2
+    placement = Placement(parsed.pin)
+    if parsed.pin == 'node' and not Placement.CanBind():
+      print('%Memory binding unavailable, pinning CPUs only',
+            file=sys.stderr)
   for sig in SIG_MAP:
     poller.Signal(sig)
+  pending = args if isinstance(args, ItemSource) else ItemSource(args)
+  history = None
+  if parsed.history:
+    if mapdict is NULL_MAP and not parsed.workers:
+      print('%s: --history requires -a, -f, or -m items' % prog,
+            file=sys.stderr)
+      return 2
+    history = History(parsed.history, command, parsed.shell)
+  if parsed.deps:
+    if not parsed.arg_file:
+      print('%s: --deps requires -f' % prog, file=sys.stderr)
+      return 2
+    # Scheduling needs all the items up front
+    items = pending.TakeAll()
+    try:
+      pending = DagSource(items, history and history.Estimator)
+    except DependencyError as exc:
+      print('%s: %s' % (prog, exc), file=sys.stderr)
+      return 2
+  elif history:
+    # Ordering needs all the items up front
+    pending = ItemSource(history.Order(pending.TakeAll()))
+  journal = None
+  if parsed.resume and not parsed.joblog:
+    print('%s: --resume requires --joblog' % prog, file=sys.stderr)
+    return 2
+  if parsed.joblog:
+    try:
+      journal = Journal(parsed.joblog, parsed.resume)
+    except (IOError, OSError) as exc:
+      print('%s: %s' % (prog, exc), file=sys.stderr)
+      return 2
+    if parsed.resume:
+      pending.Filter(journal.Skip)
+  results = None
+  if parsed.results:
+    try:
+      results = Results(parsed.results, template, mapdict)
+    except (IOError, OSError) as exc:
+      print('%s: %s' % (prog, exc), file=sys.stderr)
+      return 2
+  cgroups = None
+  if parsed.cgroup or parsed.mem_max or parsed.cpu_max:
+    try:
+      cgroups = Cgroups(parsed.mem_max, parsed.cpu_max,
+                        [zygote.pid] if zygote else [])
+    except (IOError, OSError) as exc:
+      print('%%cgroups unavailable (%s), running without them'
+            % (exc.strerror or exc), file=sys.stderr)
   started = time.time()
   if parsed.verbose and parsed.times:
     print('[Started at %s]' % TimeStr(started))
-  for arg in args:
-    if arg:
-      name = shlex.split(arg)[0]
-    else:
-      name = None
-    cmd = [Interpolate(x, arg, mapdict) for x in command]
-    try:
-      proc = Process(name, cmd, shell=parsed.shell)
-    except OSError as exc:
-      print(repr(exc), file=sys.stderr)
-      return 127
-    if parsed.times:
-      if proc.realname:
-        msg = '[%s started at %%s]' % proc.realname
-      else:
-        msg = '[Started at %s]'
-      print(msg % TimeStr(proc.started), file=sys.stderr)
-    proc.Register(poller)
-    procs.append(proc)
-  if parsed.verbose and not parsed.times:
-    print('[Started: %s]' % ','.join([x.name for x in procs]))
-  kill_time = None
-  sigs_sent = set()
-  killed = False
-  while procs:
-    if poller.sigs_rcvd:
-      sigs_to_send = poller.sigs_rcvd - sigs_sent
-      for sig in sigs_to_send:
-        if parsed.verbose:
-          print('[Forwarding signal %d (%s) to subprocesses]'
-                % (sig, SIG_MAP.get(sig, '?')),
-                file=sys.stderr)
-          sys.stderr.flush()
-        for proc in procs:
-          proc.Signal(sig)
-      sigs_sent |= sigs_to_send
-      if not kill_time:
-        if parsed.signal_test or sigs_sent - SIG_WAIT:
-          kill_time = time.time()
-    activity = False
-    for proc in procs[:]:
-      ret = proc.Poll()
-      if ret is False:
-        continue
-      if ret is True:
-        activity = True
-        # When down to last process, output in real time
-        if not parsed.sequential or len(procs) < 2:
-          proc.Print(parsed.names, parsed.times)
-        continue
-      proc.ret = ret
-      procs.remove(proc)
-      done.append(proc)
-      proc.Unregister(poller)
-      proc.Print(parsed.names, parsed.times)
-      proc.PrintLast(parsed.names, parsed.times)
-      if ret or parsed.verbose or parsed.times:
-        if proc.realname:
-          nstr = ' for ' + proc.realname
-        else:
-          nstr = ''
-        if parsed.times:
-          tstr = (' at %s, took %s'
-                  % (TimeStr(proc.finished),
-                     ElapsedStr(proc.finished - proc.started)))
-        else:
-          tstr = ''
-        print('[Returned %d%s%s]' % (ret, nstr, tstr),
-              file=sys.stderr)
-        if ret > retval:
-          retval = ret
-      if parsed.verbose and procs:
-        if len(done) > 1:
-          results = ['%s=%d' % (p.name, p.ret) for p in done]
-          print('[Returns (%d/%d): %s; retval = %d]'
-                % (len(done), len(args), ', '.join(results), retval),
-                file=sys.stderr)
-        names = [x.name for x in procs]
-        print('[Still running (%d/%d): %s]'
-              % (len(procs), len(args), ','.join(names)),
-              file=sys.stderr)
-      # If transitioning to last process while sequential, catch up
-      if parsed.sequential and len(procs) == 1:
-        procs[0].Print(parsed.names, parsed.times)
-      activity = True
-    if not activity:
-      if kill_time and time.time() - kill_time > 7:
-        if not killed:
-          print('%Killing hung subprocesses', file=sys.stderr)
-          for proc in procs:
-            proc.Kill()
-          killed = True
-        elif time.time() - kill_time > 10:
-          print('%Timed out killing subprocesses', file=sys.stderr)
-          retval = 999
-          break
-      poller.poll(5000)
+  runner = Runner(parsed, poller, command, mapdict, pending, jobs, zygote,
+                  batcher, history, pool, journal, placement, cgroups,
+                  results)
+  retval = runner.Run()
   finished = time.time()
-  numdone = len(done)
+  if journal:
+    journal.Close()
+    if parsed.verbose and pending.skipped:
+      print('[Skipped %d items already done]' % pending.skipped,
+            file=sys.stderr)
+  if history:
+    history.Save()
+  if parsed.verbose and runner.watcher.reaped:
+    print('[Reaped %d orphaned processes]' % runner.watcher.reaped,
+          file=sys.stderr)
+  if zygote:
+    zygote.Close()
+  if cgroups:
+    cgroups.Close()
+  done = runner.done
+  numdone = runner.numdone
   if numdone > 1:
     if parsed.verbose:
       if not parsed.times:
-        results = ['%s=%d' % (p.name, p.ret) for p in done]
+        results = [p.ResultStr() for p in done]
         print('[Returns: %s]' % ', '.join(results), file=sys.stderr)
       else:
         for proc in done:
-          print('[%s returned %d, took %s]'
-                % (proc.name, proc.ret,
+          print('[%s returned %d%s, took %s]'
+                % (proc.name, proc.ret, proc.AttemptStr(),
                    ElapsedStr(proc.finished - proc.started)),
                 file=sys.stderr)
       print('[All %d processes complete, final return = %d]'
             % (numdone, retval), file=sys.stderr)
     else:
-      results = ['%s=%d' % (p.name, p.ret) for p in done if p.ret]
+      results = [p.ResultStr() for p in done if p.ret]
       if results:
         print('[Failures: %s]' % ', '.join(results), file=sys.stderr)
+  if runner.dropped:
+    print('[Not run, after failed dependencies: %s]'
+          % ', '.join(runner.dropped), file=sys.stderr)
+  if runner.unfinished:
+    print('[Not run to the end, after stopping: %s]'
+          % ', '.join(runner.unfinished), file=sys.stderr)
   if parsed.times:
     print('[Finished at %s, took %s]'
           % (TimeStr(finished), ElapsedStr(finished - started)),
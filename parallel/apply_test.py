@@ -0,0 +1,41 @@
+#!/usr/bin/env python
+"""Tests for apply.py."""
+
+# Compatible with Python >=2.6
+
+from __future__ import print_function
+
+import os
+import subprocess
+import sys
+import tempfile
+import unittest
+
+import apply  # pylint: disable=redefined-builtin
+
+APPLY = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'apply.py')
+
+
+class BatcherTest(unittest.TestCase):
+  """Tests for %@ batching."""
+
+  def testShellBatchFitsOneArg(self):
+    """A -S batch must fit in the single sh -c argument."""
+    count = 20000
+    items = ['item-%015d' % x for x in range(count)]
+    assert sum([len(x) + 1 for x in items]) > apply.Batcher.MAX_ARG_STRLEN
+    with tempfile.NamedTemporaryFile(mode='w') as argfile:
+      argfile.write(''.join([x + '\n' for x in items]))
+      argfile.flush()
+      proc = subprocess.Popen([sys.executable, APPLY, '-S', '-j', '1',
+                               '-f', argfile.name, '-c', 'echo %@'],
+                              stdout=subprocess.PIPE)
+      out = proc.communicate()[0]
+    self.assertEqual(proc.returncode, 0)
+    lines = out.decode().splitlines()
+    self.assertTrue(len(lines) > 1)
+    self.assertEqual(' '.join(lines).split(), items)
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -5,10 +5,12 @@
 
 from __future__ import print_function
 
+import errno
+import fcntl
 import os
+import select
 import signal
 import sys
-import time
 
 SLEEP_TIME = 15
 
@@ -24,49 +26,45 @@ SIG_MAP = dict(zip([getattr(signal, x) for x in SIG_LIST], SIG_LIST))
 SIG_WAIT = set([getattr(signal, x) for x in ['SIGUSR1', 'SIGUSR2']])
 
 
-class Error(Exception):
-  """Base class for all locally defined exceptions."""
-
-
-class SignalInterrupt(Error):
-  """Exception for interrupts via signals."""
-  # Python >=3.5 retries EINTR, so we need an exception to break out of
-  # poll, etc.  Used instead of InterruptedError, which doesn't exist
-  # in all Python versions.
-  # However, one has to be careful to raise this exception sparingly.
-  # Not only does one want to avoid using it outside the intended calls,
-  # but some OS/Python combinations seem to have a race with the try/except
-  # setup such that the exception may miss being caught by the try/except.
-  # In this case, the backtrace actually shows the exception as occuring
-  # within the try/except that should catch it.
-
-
 class Sleeper(object):
-  """Safely interruptible sleep."""
-  # This ensures that the signal exception is limited to the actual sleep.
-  MINI_SLEEP = 0.0001
+  """Sleep which ends early on signals."""
+  # Signals are delivered via signal.set_wakeup_fd() into a pipe, and the
+  # sleep is a select() on that pipe, so there's no race with entering it.
   sigs_rcvd = set()
-  interruptible = False
+  wakeup_r = None
+
+  @classmethod
+  def _Setup(cls):
+    cls.wakeup_r, wakeup_w = os.pipe()
+    for fd in (cls.wakeup_r, wakeup_w):
+      flags = fcntl.fcntl(fd, fcntl.F_GETFL)
+      fcntl.fcntl(fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+    signal.set_wakeup_fd(wakeup_w)
 
   @classmethod
   def sleep(cls, secs):
-    """Sleep with signal interrupt allowed."""
-    cur_sigs = cls.sigs_rcvd
+    """Sleep until timeout or signal."""
+    if cls.wakeup_r is None:
+      cls._Setup()
     try:
-      # Try to avoid race with exception setup
-      time.sleep(cls.MINI_SLEEP)  # Very short sleep before interruptible
-      cls.interruptible = True
-      # Avoid a race with a signal immediately preceding "interruptible"
-      if cur_sigs == cls.sigs_rcvd:
-        time.sleep(secs - cls.MINI_SLEEP)
-      cls.interruptible = False
-    except SignalInterrupt as intexc:
-      _ = intexc  # Only for debugging
-      cls.interruptible = False
+      ready = select.select([cls.wakeup_r], [], [], secs)[0]
+    except select.error as exc:
+      # Python <3.5 reports signals as EINTR
+      if exc.args[0] != errno.EINTR:
+        raise
+      ready = []
+    if ready:
+      try:
+        while os.read(cls.wakeup_r, 4096):
+          pass
+      except OSError:
+        pass
 
   @classmethod
   def Signal(cls, signum):
     """Arm signal handler for given signal."""
+    if cls.wakeup_r is None:
+      cls._Setup()
     signal.signal(signum, cls._SignalHandler)
 
   @classmethod
@@ -79,8 +77,6 @@ class Sleeper(object):
     """
     _ = stack
     cls.sigs_rcvd |= set([signum])
-    if cls.interruptible:
-      raise SignalInterrupt(signum)
 
 
 def main(argv):
@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+"""Benchmark for apply.py's process launching at various concurrencies."""
+
+# Compatible with Python >=2.6
+
+from __future__ import print_function
+
+import os
+import resource
+import sys
+import time
+
+import apply  # pylint: disable=redefined-builtin
+
+COUNTS = [100, 1000, 10000]
+COMMAND = ['sleep', '600']
+
+
+def RaiseFdLimit():
+  """Raise the fd limit as far as allowed; return the new limit."""
+  soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+  if hard == resource.RLIM_INFINITY or hard > soft:
+    try:
+      resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+      soft = hard
+    except (ValueError, OSError):
+      pass
+  return soft
+
+
+def Bench(count, use_spawn):
+  """Launch count concurrent children; return launches per second."""
+  apply.Process.USE_SPAWN = use_spawn
+  procs = []
+  try:
+    start = time.time()
+    for _ in range(count):
+      procs.append(apply.Process('bench', COMMAND))
+    elapsed = time.time() - start
+  finally:
+    for proc in procs:
+      proc.Kill()
+    for proc in procs:
+      proc.proc.wait()
+      proc.Close()
+  return count / elapsed
+
+
+def main(argv):
+  """Main function."""
+  counts = [int(x) for x in argv[1:]] or COUNTS
+  fdlimit = RaiseFdLimit()
+  methods = [('popen', False)]
+  if hasattr(os, 'posix_spawnp'):
+    methods.append(('spawn', True))
+  print('%8s %12s %12s' % ('children', 'popen/s', 'spawn/s'))
+  for count in counts:
+    # Two pipe fds per child, plus a few of our own
+    if count * 2 + 16 > fdlimit:
+      print('%8d skipped (fd limit %d)' % (count, fdlimit))
+      continue
+    rates = [Bench(count, use_spawn) for _, use_spawn in methods]
+    print('%8d' % count + ''.join(['%13.0f' % x for x in rates]))
+    sys.stdout.flush()
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))